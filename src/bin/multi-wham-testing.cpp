@@ -1,10 +1,14 @@
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <cmath>
 #include <time.h>
 #include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 #include "split.h"
 
 // openMP - swing that hammer
@@ -13,6 +17,11 @@
 // bamtools and my headers
 #include "api/BamMultiReader.h"
 #include "readPileUp.h"
+#include "readerPool.h"
+#include "clipConsensus.h"
+#include "assocTest.h"
+#include "vcfWriter.h"
+#include "bcfWriter.h"
 
 // msa headers
 #include <seqan/align.h>
@@ -21,43 +30,91 @@
 using namespace std;
 using namespace BamTools;
 
-struct cigar{
-  char type;
-  unsigned int length;
+// a state of a region's scan, at the top of its loop: the step (count of
+// loop turns) and the fingerprint of the pileup and the read stream
+
+struct seamPoint{
+  long int step ;
+  uint64_t print;
 };
 
+struct regionSeam;
+
 struct regionDat{
   int seqidIndex ;
-  int start      ;
+  int start      ; // records are kept in [start, end]
   int end        ;
+  long int number; // for the output, see next
+  uint64_t cost  ; // compressed bytes of its reads over all BAMs
+
+  long int next      ; // number of the region written after this one
+  int      fetchStart; // reads are taken from [fetchStart, fetchEnd]
+  int      fetchEnd  ;
+  long int synced    ; // the step from which the scan matches an unsplit one
+  regionSeam * left  ; // set until checked against the region before
+  regionSeam * right ; // set when split from the region after
+
+  // a finished scan waiting for the region before it
+  vector<seamPoint>    head   ;
+  vector<seamPoint>    tail   ;
+  string               ready  ;
+  vector<outputRecord> indexed;
+};
+
+// the boundary between a region split while it ran and the region cut
+// off after it, which starts reading a halo early.  The left scan keeps
+// the states it passes once reads reach from, up to its first record
+// past the boundary; the right scan keeps its states up to its first
+// record of its own.  Scans are deterministic, so a state both pass
+// through means the right scan matches an unsplit one from there on.
+// Only read or written under the queue lock.
+
+struct regionSeam{
+  int      halo      ;
+  long int from      ;
+  bool     leftDone  ;
+  int      leftFetch ; // for running the right region again from there
+  long int leftSynced;
+  vector<uint64_t> tail; // sorted
+  regionDat * parked ; // the right region, finished before the left
 };
 
-struct indvDat{
-  bool   support       ;
-  string genotype      ;
-  int    genotypeIndex ; 
-  int    nReads        ;
-  int    mappedPairs   ;
-  int    nAboveAvg     ;
-  int    notMapped     ;
-  int    mateMissing   ;
-  int    sameStrand    ;
-  int    nClipping     ; 
-  int    mateCrossChromosome ;
-  int    maxLength      ;
-  double    nBad        ;
-  double    nGood       ;
-  double insertSum ;
-  double insertMean ;
-  double lengthSum ;
-  double clipped ;
-  vector<double> inserts;
-  vector<double> hInserts;
+// the per sample tallies of one candidate, as parallel arrays indexed
+// by sample (the order of globalOpts.all).  Each thread keeps one and
+// resets it for every candidate, so scoring allocates nothing per sample.
+
+struct sampleTable{
+  unsigned int n;
+
+  vector<int>    genotypeIndex; // -1 when there are too few reads
+  vector<int>    nReads       ;
+  vector<int>    mappedPairs  ;
+  vector<int>    nAboveAvg    ;
+  vector<int>    sameStrand   ;
+  vector<int>    nClipping    ;
+  vector<double> nBad         ;
+  vector<double> nGood        ;
+
+  // genotype likelihoods, three per sample
   vector<long double> gls;
-  vector< BamAlignment > alignments;
-  vector<int> badFlag;
-  vector<int> MapQ;
-  map<int, vector<string> > cluster;
+
+  // reads by mapping quality, the ones flagged bad and the rest, 256
+  // bins per sample.  Only minQ to maxQ of a sample are in use.
+  vector<int> badQ ;
+  vector<int> goodQ;
+  vector<int> minQ ;
+  vector<int> maxQ ;
+
+  // scratch for permuteLRT()
+  vector<int> permuted;
+
+#ifdef DEBUG
+  vector< vector< pileupRead * > > alignments;
+  vector< vector< int > >          badFlag;
+#endif
+
+  void resize(unsigned int);
+  void reset(void);
 };
 
 struct insertDat{
@@ -65,6 +122,8 @@ struct insertDat{
   map<string, double> sds;  // standard deviation
   map<string, double> lq ;  // 25% of data
   map<string, double> up ;  // 75% of the data
+  vector<double> mu     ;  // mus by sample index, the order of globalOpts.all
+  vector<double> maxDiff;  // largest normal distance from mu, 3 sds
 } insertDists;
 
 struct global_opts {
@@ -72,6 +131,11 @@ struct global_opts {
   vector<string> backgroundBams;
   vector<string> all           ;
   int            nthreads      ;
+  int            ninflaters    ;
+  bool           msaConsensus  ;
+  string         output        ;
+  bool           bcf           ;
+  int            nPermutations ;
   string         seqid         ;
   string         bed           ; 
   vector<int>    region        ; 
@@ -80,6 +144,8 @@ struct global_opts {
 
 struct info_field{
   double lrt;
+  double fe ;
+  double pv ;
 
   double taf;
   double baf;
@@ -96,16 +162,30 @@ struct info_field{
 
 };
 
-static const char *optString ="ht:b:r:x:e:";
+static const char *optString ="ht:b:r:x:e:d:mp:o:";
 
 // this lock prevents threads from printing on top of each other
 
 omp_lock_t lock;
 
+// per thread BAM readers, opened once and re-seeked for each region
+
+readerPool * readers;
+
+// per thread consensus sequences, indexed by omp_get_thread_num()
+
+vector<consensusCache> consensusCaches;
+
+// per thread sample tables, indexed by omp_get_thread_num()
+
+vector<sampleTable> sampleTables;
+
 bool sortStringSize(string i, string j) {return (i.size() < j.size());}
 
 void initInfo(info_field * s){
   s->lrt = 0;
+  s->fe  = 1;
+  s->pv  = 1;
   s->taf = 0.000001;
   s->baf = 0.000001;
   s->aaf = 0.000001;
@@ -117,29 +197,71 @@ void initInfo(info_field * s){
   s->bgc = 0;
 }
 
-void initIndv(indvDat * s){
-  s->support             = false;
-  s->genotype            = "./.";
-  s->genotypeIndex       = -1;
-  s->nBad                = 0;
-  s->nClipping           = 0;
-  s->nGood               = 0;
-  s->nReads              = 0;
-  s->nAboveAvg           = 0;
-  s->notMapped           = 0;
-  s->mappedPairs         = 0;
-  s->mateMissing         = 0;
-  s->insertSum           = 0;
-  s->sameStrand          = 0;
-  s->maxLength           = 0;
-  s->mateCrossChromosome = 0;
-  s->lengthSum           = 0;
-  s->clipped             = 0;
-  s->alignments.clear();
-  s->inserts.clear();
-  s->hInserts.clear();
-  s->badFlag.clear();
-  s->MapQ.clear();
+void sampleTable::resize(unsigned int size){
+  n = size;
+  genotypeIndex.resize(n);
+  nReads.resize(n);
+  mappedPairs.resize(n);
+  nAboveAvg.resize(n);
+  sameStrand.resize(n);
+  nClipping.resize(n);
+  nBad.resize(n);
+  nGood.resize(n);
+  gls.resize(3 * n);
+  badQ.resize(256 * n);
+  goodQ.resize(256 * n);
+  minQ.resize(n);
+  maxQ.resize(n);
+#ifdef DEBUG
+  alignments.resize(n);
+  badFlag.resize(n);
+#endif
+}
+
+// the histograms are not cleared here, loadIndv() zeroes bins as a
+// sample starts to use them
+
+void sampleTable::reset(void){
+  fill(genotypeIndex.begin(), genotypeIndex.end(), -1);
+  fill(nReads.begin(),        nReads.end(),        0);
+  fill(mappedPairs.begin(),   mappedPairs.end(),   0);
+  fill(nAboveAvg.begin(),     nAboveAvg.end(),     0);
+  fill(sameStrand.begin(),    sameStrand.end(),    0);
+  fill(nClipping.begin(),     nClipping.end(),     0);
+  fill(nBad.begin(),          nBad.end(),          0);
+  fill(nGood.begin(),         nGood.end(),         0);
+  fill(gls.begin(),           gls.end(),           0);
+  fill(minQ.begin(),          minQ.end(),          256);
+  fill(maxQ.begin(),          maxQ.end(),          -1);
+#ifdef DEBUG
+  for(unsigned int i = 0; i < n; i++){
+    alignments[i].clear();
+    badFlag[i].clear();
+  }
+#endif
+}
+
+// the permutations of a site do not depend on which thread scores it
+
+uint64_t siteSeed(string & seqid, long int pos){
+  uint64_t h = 14695981039346656037ULL;
+  for(string::iterator c = seqid.begin(); c != seqid.end(); c++){
+    h = (h ^ (unsigned char)(*c)) * 1099511628211ULL;
+  }
+  return h ^ (uint64_t) pos;
+}
+
+const char * genotypeText(int genotypeIndex){
+  switch(genotypeIndex){
+  case 0:
+    return "0/0";
+  case 1:
+    return "0/1";
+  case 2:
+    return "1/1";
+  default:
+    return "./.";
+  }
 }
 
 string collapseCigar(vector<CigarOp> & v){
@@ -156,32 +278,40 @@ string collapseCigar(vector<CigarOp> & v){
 
 }
 
-void printHeader(void){
-  cout << "##fileformat=VCFv4.1"                                                                                                                  << endl;
-  cout << "##INFO=<ID=LRT,Number=1,Type=Float,Description=\"Likelihood Ratio Test Statistic\">"                                                       << endl;
-  cout << "##INFO=<ID=AF,Number=3,Type=Float,Description=\"Allele frequency of: background,target,combined\">" << endl;
-  cout << "##INFO=<ID=GC,Number=2,Type=Integer,Description=\"Number of called genotypes in: background,target\">"  << endl;
-  cout << "##INFO=<ID=AT,Number=15,Type=Float,Description=\"Attributes for classification\">"                                              << endl;
-  cout << "##INFO=<ID=CU,Number=1,Type=Integer,Description=\"Number of neighboring soft clip clusters across all individuals at pileup position \">" << endl;
-  cout << "##INFO=<ID=ED,Number=.,Type=String,Description=\"Colon separated list of potenial paired breakpoints, in the format: seqid,pos,count\">" << endl;
-  cout << "##INFO=<ID=BE,Number=3,Type=String,Description=\"Best end position: chr,position,count\">"                  << endl;
-  cout << "##INFO=<ID=DI,Number=1,Type=Character,Description=\"Consensus is from front or back of pileup : f,b\">"      << endl;
-  cout << "##INFO=<ID=NC,Number=1,Type=String,Description=\"Number of soft clipped sequences collapsed into consensus\">"                  << endl;
-  cout << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">"                                                                 << endl;
-  cout << "##FORMAT=<ID=GL,Number=A,Type=Float,Description=\"Genotype likelihood \">"                                                                 << endl;
-  cout << "##FORMAT=<ID=FR,Number=1,Type=Float,Description=\"Fraction of reads with soft or hard clipping\">"                                << endl;
-  cout << "##FORMAT=<ID=NR,Number=1,Type=Integer,Description=\"Number of reads that do not support a SV\">"                                                      << endl;
-  cout << "##FORMAT=<ID=NA,Number=1,Type=Integer,Description=\"Number of reads supporting a SV\">"                                                      << endl;
-  cout << "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Number of reads with mapping quality greater than 0\">"                                << endl;
-  cout << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT" << "\t";
+void printHeader(ostream & out, vector< RefData > & contigs){
+  out << "##fileformat=VCFv4.1"                                                                                                                  << endl;
+  out << "##FILTER=<ID=PASS,Description=\"All filters passed\">"                                                                             << endl;
+  for(vector< RefData >::iterator c = contigs.begin(); c != contigs.end(); c++){
+    out << "##contig=<ID=" << (*c).RefName << ",length=" << (*c).RefLength << ">" << endl;
+  }
+  out << "##INFO=<ID=LRT,Number=1,Type=Float,Description=\"Likelihood Ratio Test Statistic\">"                                                       << endl;
+  out << "##INFO=<ID=FE,Number=1,Type=Float,Description=\"Two sided Fisher exact test p-value of the allele counts in: background,target\">" << endl;
+  if(globalOpts.nPermutations > 0){
+    out << "##INFO=<ID=PV,Number=1,Type=Float,Description=\"Permutation p-value of the LRT, sequential stopping after " << PERMUTE_HITS << " hits\">" << endl;
+  }
+  out << "##INFO=<ID=AF,Number=3,Type=Float,Description=\"Allele frequency of: background,target,combined\">" << endl;
+  out << "##INFO=<ID=GC,Number=2,Type=Integer,Description=\"Number of called genotypes in: background,target\">"  << endl;
+  out << "##INFO=<ID=AT,Number=15,Type=Float,Description=\"Attributes for classification\">"                                              << endl;
+  out << "##INFO=<ID=CU,Number=1,Type=Integer,Description=\"Number of neighboring soft clip clusters across all individuals at pileup position \">" << endl;
+  out << "##INFO=<ID=ED,Number=.,Type=String,Description=\"Colon separated list of potenial paired breakpoints, in the format: seqid,pos,count\">" << endl;
+  out << "##INFO=<ID=BE,Number=3,Type=String,Description=\"Best end position: chr,position,count\">"                  << endl;
+  out << "##INFO=<ID=DI,Number=1,Type=Character,Description=\"Consensus is from front or back of pileup : f,b\">"      << endl;
+  out << "##INFO=<ID=NC,Number=1,Type=String,Description=\"Number of soft clipped sequences collapsed into consensus\">"                  << endl;
+  out << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">"                                                                 << endl;
+  out << "##FORMAT=<ID=GL,Number=G,Type=Float,Description=\"Genotype likelihood \">"                                                                 << endl;
+  out << "##FORMAT=<ID=FR,Number=1,Type=Float,Description=\"Fraction of reads with soft or hard clipping\">"                                << endl;
+  out << "##FORMAT=<ID=NR,Number=1,Type=Integer,Description=\"Number of reads that do not support a SV\">"                                                      << endl;
+  out << "##FORMAT=<ID=NA,Number=1,Type=Integer,Description=\"Number of reads supporting a SV\">"                                                      << endl;
+  out << "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Number of reads with mapping quality greater than 0\">"                                << endl;
+  out << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT" << "\t";
 
   for(unsigned int b = 0; b < globalOpts.all.size(); b++){
-    cout << globalOpts.all[b] ;
+    out << globalOpts.all[b] ;
     if(b < globalOpts.all.size() - 1){
-      cout << "\t";
+      out << "\t";
     }
   }
-  cout << endl;  
+  out << endl;  
 }
 
 string joinComma(vector<string> & strings){
@@ -198,47 +328,48 @@ string joinComma(vector<string> & strings){
 
 }
 
-string printIndvDat(  indvDat * d ){
+string printIndvDat(  sampleTable & d, unsigned int i ){
 
   stringstream ss;
 
-  ss << "Genotype       : .......... " << d->genotype          << endl;
-  ss << "Genotype index : .......... " << d->genotypeIndex     << endl;
-  ss << "Number of reads: .......... " << d->badFlag.size()    << endl;
-  ss << "Number of mapped mates: ... " << d->mappedPairs       << endl;
-  ss << "Number of odd insert size:  " << d->nAboveAvg         << endl;
-  ss << "Number of reads not mapped: " << d->notMapped         << endl;
-  ss << "Number of mates missing: .. " << d->mateMissing       << endl;
-  ss << "Number of mates same strand:" << d->sameStrand        << endl;
-  ss << "Number of reads clipped: .. " << d->nClipping         << endl;
-  ss << "Number of alternative reads:" << d->nBad              << endl;
-  ss << "Number of reference reads:  " << d->nGood             << endl;
-  ss << "Genotype likelihoods: ..... " << d->gls[0] 
-     << ":" << d->gls[1] 
-     << ":" << d->gls[2] 
+  ss << "Genotype       : .......... " << genotypeText(d.genotypeIndex[i]) << endl;
+  ss << "Genotype index : .......... " << d.genotypeIndex[i]     << endl;
+  ss << "Number of reads: .......... " << d.nReads[i]            << endl;
+  ss << "Number of mapped mates: ... " << d.mappedPairs[i]       << endl;
+  ss << "Number of odd insert size:  " << d.nAboveAvg[i]         << endl;
+  ss << "Number of mates same strand:" << d.sameStrand[i]        << endl;
+  ss << "Number of reads clipped: .. " << d.nClipping[i]         << endl;
+  ss << "Number of alternative reads:" << d.nBad[i]              << endl;
+  ss << "Number of reference reads:  " << d.nGood[i]             << endl;
+  ss << "Genotype likelihoods: ..... " << d.gls[3*i] 
+     << ":" << d.gls[3*i + 1] 
+     << ":" << d.gls[3*i + 2] 
      << endl;
   ss << endl;
   ss << "Reads: " << endl;
 
+#ifdef DEBUG
   int z = 0;
 
-  for(vector< BamAlignment >::iterator it = d->alignments.begin(); it != d->alignments.end(); it++){
+  for(vector< pileupRead * >::iterator it = d.alignments[i].begin(); it != d.alignments[i].end(); it++){
    
-    ss   << " " << (*it).Name << " " 
-         << d->badFlag[z] << " "
-         << (*it).RefID    << " " 
-	 << (*it).Position << " " 
-	 << (*it).GetEndPosition() << " "
-	 << (*it).Position + (*it).Length << " "
-         << (*it).MapQuality << " " 
-         << (*it).MateRefID    << " " 
-         << (*it).MatePosition << " " 
-	 << collapseCigar((*it).CigarData) << " " 
-         << (*it).AlignmentFlag << " " 
-	 << (*it).QueryBases 
+    ss   << " " << (*it)->Name << " " 
+         << d.badFlag[i][z] << " "
+         << (*it)->RefID    << " " 
+	 << (*it)->Position << " " 
+	 << (*it)->GetEndPosition() << " "
+	 << (*it)->Position + (*it)->Length << " "
+         << int((*it)->MapQuality) << " " 
+         << (*it)->MateRefID    << " " 
+         << (*it)->MatePosition << " " 
+	 << (*it)->frontLength << (*it)->frontType << "..." 
+	 << (*it)->backLength  << (*it)->backType  << " " 
+         << (*it)->AlignmentFlag << " " 
+	 << (*it)->frontClip << "," << (*it)->backClip 
 	 << endl;
     z++;
   }
+#endif
 
   return ss.str();
 
@@ -273,6 +404,11 @@ void printHelp(void){
   cerr << "option  : r <STRING> -- a genomic region in the format \"seqid:start-end\"" << endl ;
   cerr << "option  : x <INT>    -- set the number of threads, otherwise max          " << endl ; 
   cerr << "option  : e <STRING> -- a bedfile that defines regions to score           " << endl ; 
+  cerr << "option  : d <INT>    -- helper threads for BAM decompression [2]          " << endl ; 
+  cerr << "option  : m          -- build the consensus with seqan's MSA (slow)       " << endl ; 
+  cerr << "option  : p <INT>    -- permute the LRT up to this many times [0 = off]   " << endl ; 
+  cerr << "option  : o <STRING> -- write bgzipped VCF and a tabix index, not stdout  " << endl ; 
+  cerr << "                        or BCF and a CSI index if the name ends in .bcf   " << endl ; 
   cerr << endl;
   printVersion();
 }
@@ -281,6 +417,8 @@ void parseOpts(int argc, char** argv){
   int opt = 0;
 
   globalOpts.bed = "NA";
+  globalOpts.output = "NA";
+  globalOpts.bcf    = false;
 
   opt = getopt(argc, argv, optString);
 
@@ -298,6 +436,37 @@ void parseOpts(int argc, char** argv){
 	cerr << "INFO: OpenMP will roughly use " << globalOpts.nthreads << " threads" << endl;
 	break;
       }
+    case 'd':
+      {
+	globalOpts.ninflaters = atoi(((string)optarg).c_str());
+	cerr << "INFO: " << globalOpts.ninflaters << " threads will help decompress BAMs" << endl;
+	break;
+      }
+    case 'm':
+      {
+	globalOpts.msaConsensus = true;
+	cerr << "INFO: consensus sequences will come from seqan's multiple alignment" << endl;
+	break;
+      }
+    case 'o':
+      {
+	globalOpts.output = optarg;
+	globalOpts.bcf    = globalOpts.output.size() > 4
+	  && globalOpts.output.compare(globalOpts.output.size() - 4, 4, ".bcf") == 0;
+	if(globalOpts.bcf){
+	  cerr << "INFO: WHAM-BAM will write BCF and its CSI index to: " << globalOpts.output << endl;
+	}
+	else{
+	  cerr << "INFO: WHAM-BAM will write a bgzipped VCF and its tabix index to: " << globalOpts.output << endl;
+	}
+	break;
+      }
+    case 'p':
+      {
+	globalOpts.nPermutations = atoi(((string)optarg).c_str());
+	cerr << "INFO: the LRT will be permuted up to " << globalOpts.nPermutations << " times" << endl;
+	break;
+      }
     case 't':
       {
 	globalOpts.targetBams     = split(optarg, ",");
@@ -391,6 +560,13 @@ double var(vector<double> & data, double mu){
 
 bool grabInsertLengths(string file){
 
+  // loads the index into the shared cache before the workers start
+
+  if(indexCache.get(file) == NULL){
+    cerr << "FATAL: unable to load the index for: " << file << endl;
+    exit(1);
+  }
+
   BamReader bamR;
   BamAlignment al;
 
@@ -409,7 +585,7 @@ bool grabInsertLengths(string file){
     }
     if(al.IsMapped()){
       naligned += 1;
-      vector< CigarOp > cd = al.CigarData;
+      const vector< CigarOp > & cd = al.CigarData;
 
       if(cd.back().Type == 'S' || cd.back().Type == 'H' ){
         clipped += double(cd.back().Length) / double (al.Length);
@@ -450,6 +626,8 @@ bool getInsertDists(void){
 
   for(unsigned int i = 0; i < globalOpts.all.size(); i++){
     flag = grabInsertLengths(globalOpts.all[i]);
+    insertDists.mu.push_back(insertDists.mus[globalOpts.all[i]]);
+    insertDists.maxDiff.push_back(3.0 * insertDists.sds[globalOpts.all[i]]);
   }
   
   return true;
@@ -499,14 +677,6 @@ void prepBams(BamMultiReader & bamMreader, string group){
 
 }
 
-double logLbinomial(double x, double n, double p){
-
-  double ans = lgamma(n+1)-lgamma(x+1)-lgamma(n-x+1) + x * log(p) + (n-x) * log(1-p);
-  return ans;
-
-}
-
-
 double logDbeta(double alpha, double beta, double x){
   
   double ans = 0;
@@ -536,61 +706,80 @@ double unphred(double p){
   return pow(10, (-p/10));
 }
 
-bool processGenotype(indvDat * idat, double * totalAlt){
+// log likelihood of one read under each genotype (0/0, 0/1, 1/1), by
+// whether it supports the alternative and by its mapping quality
+
+double mapqGL[2][256][3];
+
+void initMapqGL(void){
+  for(int q = 0; q < 256; q++){
+    double mappingP = unphred(q);
+
+    mapqGL[0][q][0] = log((2 - 2)*mappingP + (2*(1-mappingP)));
+    mapqGL[0][q][1] = log((2 - 1)*mappingP + (1*(1-mappingP)));
+    mapqGL[0][q][2] = log((2 - 0)*mappingP + (0*(1-mappingP)));
+
+    mapqGL[1][q][0] = log((2-2) * (1-mappingP) + (2*mappingP));
+    mapqGL[1][q][1] = log((2-1) * (1-mappingP) + (1*mappingP));
+    mapqGL[1][q][2] = log((2-0) * (1-mappingP) + (0*mappingP));
+  }
+}
+
+bool processGenotype(sampleTable & d, unsigned int i, double * totalAlt){
 
-  string genotype = "./.";
+  long double * gl = &d.gls[3 * i];
 
   long double aal = 0;
   long double abl = 0;
   long double bbl = 0;
 
-  if(idat->badFlag.size() < 3){
-    idat->gls.push_back(-255.0);
-    idat->gls.push_back(-255.0);
-    idat->gls.push_back(-255.0);
+  if(d.nReads[i] < 3){
+    gl[0] = -255.0;
+    gl[1] = -255.0;
+    gl[2] = -255.0;
     return true;
   }
 
   double nref = 0.0;
   double nalt = 0.0;
 
-  int ri = 0;
+  // bad reads only count as alternative once the sample has clipping
 
-  for(vector< int >::iterator rit = idat->badFlag.begin(); rit != idat->badFlag.end(); rit++){
-    if(ri > 1000){
-      break;
-    }
+  bool clipped = d.nClipping[i] > 1;
+
+  const int * badQ  = &d.badQ[256 * i];
+  const int * goodQ = &d.goodQ[256 * i];
 
-    double mappingP = unphred(idat->MapQ[ri]);
+  for(int q = d.minQ[i]; q <= d.maxQ[i]; q++){
 
-    if( *rit == 1 && idat->nClipping > 1){
-      nalt += 1;
-      aal += log((2-2) * (1-mappingP) + (2*mappingP)) ;
-      abl += log((2-1) * (1-mappingP) + (1*mappingP)) ;
-      bbl += log((2-0) * (1-mappingP) + (0*mappingP)) ;
+    int na = clipped ? badQ[q] : 0;
+    int nr = clipped ? goodQ[q] : goodQ[q] + badQ[q];
 
+    if(na > 0){
+      nalt += na;
+      aal  += na * mapqGL[1][q][0];
+      abl  += na * mapqGL[1][q][1];
+      bbl  += na * mapqGL[1][q][2];
     }
-    else{
-      nref += 1;
-      aal += log((2 - 2)*mappingP + (2*(1-mappingP)));
-      abl += log((2 - 1)*mappingP + (1*(1-mappingP)));
-      bbl += log((2 - 0)*mappingP + (0*(1-mappingP)));
+    if(nr > 0){
+      nref += nr;
+      aal  += nr * mapqGL[0][q][0];
+      abl  += nr * mapqGL[0][q][1];
+      bbl  += nr * mapqGL[0][q][2];
     }
-    ri++;
   }
 
-  idat->nBad  = nalt;
-  idat->nGood = nref;
+  d.nBad[i]  = nalt;
+  d.nGood[i] = nref;
 
-  double nreads = idat->nReads;
+  double nreads = d.nReads[i];
 
-  if(nreads > 1000){
-    nreads = 1000;
-  }
+  // the normalization of the genotype likelihood, 2^nreads taken in log
+  // space so high depth does not overflow
 
-  aal = aal - log(pow(2,nreads)); // the normalization of the genotype likelihood
-  abl = abl - log(pow(2,nreads)); // this is causing underflow for really high depth.
-  bbl = bbl - log(pow(2,nreads));
+  aal = aal - nreads * log(2.0);
+  abl = abl - nreads * log(2.0);
+  bbl = bbl - nreads * log(2.0);
 
   if(nref == 0){
     aal = -255.0;
@@ -602,28 +791,24 @@ bool processGenotype(indvDat * idat, double * totalAlt){
   }
 
   double max = aal;
-  genotype     = "0/0";
-  idat->genotypeIndex = 0;
+  d.genotypeIndex[i] = 0;
 
   if(abl > max){
-    genotype = "0/1";
-    idat->genotypeIndex = 1;
+    d.genotypeIndex[i] = 1;
     (*totalAlt) += 1;
     max = abl;
   }
   if(bbl > max){
-    genotype = "1/1";
-    idat->genotypeIndex = 2;
+    d.genotypeIndex[i] = 2;
     (*totalAlt) += 2;
   }
 
-  idat->genotype = genotype;
-  idat->gls.push_back(aal);
-  idat->gls.push_back(abl);
-  idat->gls.push_back(bbl);
+  gl[0] = aal;
+  gl[1] = abl;
+  gl[2] = bbl;
 
 #ifdef DEBUG
-   cerr << genotype << "\t" << aal << "\t" << abl << "\t" << bbl << "\t" << nref << "\t"  << endl;
+   cerr << genotypeText(d.genotypeIndex[i]) << "\t" << aal << "\t" << abl << "\t" << bbl << "\t" << nref << "\t"  << endl;
 #endif
   return true;
 
@@ -657,7 +842,7 @@ bool checkN(string & s){
   return false;
 }
 
-bool loadIndv(map<string, indvDat*> & ti, 
+bool loadIndv(sampleTable & d, 
 	      readPileUp & pileup, 
 	      global_opts & localOpts, 
 	      insertDat & localDists, 
@@ -666,253 +851,158 @@ bool loadIndv(map<string, indvDat*> & ti,
 	      ){    
 
   
-  for(list<BamAlignment>::iterator r = pileup.currentData.begin(); r != pileup.currentData.end(); r++){
-   
-    if((*r).Position > *pos){
-      continue;
-    }
+  // live primary reads starting at or before pos
+  pileup.findPrimaries(*pos);
 
-    if( ((*r).AlignmentFlag & 0x0800) != 0 || ! (*r).IsPrimaryAlignment()){
-      continue;
-    }
+  for(unsigned int i = 0; i < pileup.nPrimaries; i++){
 
-    string fname = (*r).Filename;
+    pileupRead * r = &pileup.at(pileup.primaries[i]);
 
-    int bad = 0;
+    uint16_t id = r->sample;
 
-    vector< CigarOp > cd = (*r).CigarData;
+    int bad = 0;
 
-    if( ((pileup.primaryCount[(*r).Position] > 1) || (pileup.primaryCount[(*r).GetEndPosition()] > 1))
-	&& (cd.front().Type == 'S' || cd.back().Type == 'S') ){
+    if( ((pileup.nPrimary(r->Position) > 1) || (pileup.nPrimary(r->GetEndPosition()) > 1))
+	&& (r->frontType == 'S' || r->backType == 'S') ){
       bad = 1;
-      ti[fname]->nClipping++;
+      d.nClipping[id]++;
     }
     
-    if((*r).IsMapped() && (*r).IsMateMapped() && (*r).IsProperPair()){
+    if(r->IsMapped() && r->IsMateMapped() && r->IsProperPair()){
 
-      ti[fname]->insertSum    += abs(double((*r).InsertSize));
-      ti[fname]->mappedPairs  += 1;
+      d.mappedPairs[id] += 1;
       
-      if(( (*r).IsReverseStrand() && (*r).IsMateReverseStrand() ) || ( !(*r).IsReverseStrand() && !(*r).IsMateReverseStrand() )){
+      if(( r->IsReverseStrand() && r->IsMateReverseStrand() ) || ( !r->IsReverseStrand() && !r->IsMateReverseStrand() )){
 	bad = 1;
-	ti[fname]->sameStrand += 1;
+	d.sameStrand[id] += 1;
       }
       
-      double ilength = abs ( double ( (*r).InsertSize ));
-      
-      double iDiff = abs ( ilength - localDists.mus[(*r).Filename] );
+      double ilength = abs ( double ( r->InsertSize ));
       
-      ti[fname]->inserts.push_back(ilength);
+      double iDiff = abs ( ilength - localDists.mu[id] );
       
-      if(iDiff > (3.0 * insertDists.sds[(*r).Filename]) ){
+      if(iDiff > localDists.maxDiff[id] ){
 	bad = 1;
-	ti[fname]->nAboveAvg += 1;
-	ti[fname]->hInserts.push_back(ilength);
+	d.nAboveAvg[id] += 1;
       }
     }
 
-    ti[fname]->nReads++;
+    d.nReads[id]++;
 
-    map<string, int>::iterator os = pileup.odd.find((*r).Name);
-
-    if(os !=  pileup.odd.end()){
+    if(pileup.odd.has(r->nameHash)){
       bad = 1;
     }
 
     if(bad == 1){
-      ti[fname]->nBad += 1;
+      d.nBad[id] += 1;
     }
     else{
-      ti[fname]->nGood += 1;
+      d.nGood[id] += 1;
     }
-    ti[fname]->badFlag.push_back( bad );
 #ifdef DEBUG
-    ti[fname]->alignments.push_back(*r);
+    d.badFlag[id].push_back( bad );
+    d.alignments[id].push_back(r);
 #endif
-    ti[fname]->MapQ.push_back((*r).MapQuality);
-  }
-  return true;
-}
 
+    // bins are zeroed as the range in use grows to cover q
 
-bool cleanUp( map < string, indvDat*> & ti, global_opts localOpts){
-  for(vector<string>::iterator all = localOpts.all.begin(); all != localOpts.all.end(); all++ ){
-    delete ti[*all];
-  }
-  return true;
-}
-
-bool loadInfoField(map<string, indvDat*> dat, info_field * info, global_opts & opts){
-  
-  for(unsigned int b = 0; b < opts.backgroundBams.size(); b++){
+    int   q     = r->MapQuality;
+    int * badQ  = &d.badQ[256 * id];
+    int * goodQ = &d.goodQ[256 * id];
+    int & minQ  = d.minQ[id];
+    int & maxQ  = d.maxQ[id];
 
-    if( dat[opts.backgroundBams[b]]->genotypeIndex == -1){
-      continue;
+    if(maxQ < minQ){
+      minQ     = q;
+      maxQ     = q;
+      badQ[q]  = 0;
+      goodQ[q] = 0;
+    }
+    while(q < minQ){
+      minQ -= 1;
+      badQ[minQ]  = 0;
+      goodQ[minQ] = 0;
+    }
+    while(q > maxQ){
+      maxQ += 1;
+      badQ[maxQ]  = 0;
+      goodQ[maxQ] = 0;
     }
-    info->nat += 2 - dat[opts.backgroundBams[b]]->genotypeIndex;
-    info->nbt +=     dat[opts.backgroundBams[b]]->genotypeIndex;
-    info->tgc += 1;
-  }
 
-  for(unsigned int t = 0; t < opts.targetBams.size(); t++){
-    if(dat[opts.targetBams[t]]->genotypeIndex == -1){
-      continue;
+    if(bad == 1){
+      badQ[q]  += 1;
+    }
+    else{
+      goodQ[q] += 1;
     }
-    info->nab += 2 - dat[opts.targetBams[t]]->genotypeIndex;
-    info->nbb +=     dat[opts.targetBams[t]]->genotypeIndex;
-    info->bgc += 1;
   }
+  return true;
+}
 
-  info->taf += info->nbt / (info->nat + info->nbt);
-  info->baf += info->nbb / (info->nab + info->nbb);
-  info->aaf += (info->nbt + info->nbb) / (info->nat + info->nbt + info->nab + info->nbb);
+bool loadInfoField(sampleTable & dat, info_field * info, global_opts & opts){
 
-  double alt  = logLbinomial(info->nbt, (info->tgc * 2), info->taf) + logLbinomial(info->nbb, (2* info->bgc), info->baf);
-  double null = logLbinomial(info->nbt, (info->tgc * 2), info->aaf) + logLbinomial(info->nbb, (2* info->bgc), info->aaf);
+  // dat is in the order of opts.all: the targets, then the backgrounds
 
-  info->lrt = 2 * (alt - null);
-  
-  return true;
+  unsigned int nt = opts.targetBams.size();
 
-}
+  int nCalled, nAlt;
 
+  countAlleles(&dat.genotypeIndex[nt], dat.n - nt, &nCalled, &nAlt);
 
-string infoText(info_field * info){
-  
-  stringstream ss;
+  info->nat += 2 * nCalled - nAlt;
+  info->nbt +=     nAlt;
+  info->tgc +=     nCalled;
 
-  ss << "LRT=" << info->lrt << ";";
-  ss << "AF="  << info->taf << "," << info->baf << "," << info->aaf << ";";
-  ss << "GC="  << info->tgc << "," << info->bgc << ";";
+  countAlleles(&dat.genotypeIndex[0], nt, &nCalled, &nAlt);
 
-  return ss.str();
+  info->nab += 2 * nCalled - nAlt;
+  info->nbb +=     nAlt;
+  info->bgc +=     nCalled;
 
-}
+  double af[3];
 
-bool burnCigar(string s, vector<cigar> & cigs){
-  
-  unsigned int offset = 0;
-  unsigned int index  = 0; 
+  info->lrt = allelicLRT(info->tgc, info->nbt, info->bgc, info->nbb, af);
 
-  for(string::iterator it = s.begin() ; it != s.end(); it++){
+  info->taf = af[0];
+  info->baf = af[1];
+  info->aaf = af[2];
 
-    switch(*it){
-    case 'M':
-      {
-	cigar c;
-	c.type   = 'M';
-	c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      }
-    case 'I':
-      {
-        cigar c;
-	c.type   = 'I';
-        c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      }
-    case 'D':
-      {
-        cigar c;
-	c.type   = 'D';
-        c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      }
-    case 'N':
-      {
-        cigar c;
-	c.type   = 'N';
-        c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      }
-    case 'S':
-      {
-        cigar c;
-	c.type   = 'S';
-        c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      }
-    case 'H':
-      {
-        cigar c;
-	c.type   = 'H';
-        c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      }
-    case 'P':
-      {
-        cigar c;
-	c.type   = 'P';
-        c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      }
-    case 'X':
-      {
-        cigar c;
-	c.type   = 'X';
-        c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      } 
-    case '=':
-      {
-        cigar c;
-	c.type   = '=';
-        c.length = atoi(s.substr(offset, index-offset).c_str());
-	cigs.push_back(c);
-	offset = index + 1;
-	break;
-      }
-    default:
-      break;
-    }
-    index += 1;
-  }
-  //cerr << "done burning" << endl;
-  return true;
-}
+  // the same allele counts as a 2x2 table
 
-void endPos(vector<cigar> & cigs, long int * pos){
+  info->fe  = fisherExact(info->nat, info->nbt, info->nab, info->nbb);
   
-  for(vector<cigar>::iterator it = cigs.begin(); 
-      it != cigs.end(); it++){
-    
-    switch( (*it).type ){
-    case 'I':
-      {
-	*pos += (*it).length;
-	break;
-      }
-    case 'M':
-      {
-	*pos += (*it).length;
-	break;
-      }
-    default:
-      break;
-    }
-  }
+  return true;
+
 }
 
 
+void infoText(info_field * info, string & out){
+  
+  out.append("LRT=");
+  appendFloat(out, info->lrt);
+  out.append(";FE=");
+  appendFloat(out, info->fe);
+  out.append(";");
+  if(globalOpts.nPermutations > 0){
+    out.append("PV=");
+    appendFloat(out, info->pv);
+    out.append(";");
+  }
+  out.append("AF=");
+  appendFloat(out, info->taf);
+  out.append(",");
+  appendFloat(out, info->baf);
+  out.append(",");
+  appendFloat(out, info->aaf);
+  out.append(";GC=");
+  appendFloat(out, info->tgc);
+  out.append(",");
+  appendFloat(out, info->bgc);
+  out.append(";");
+}
 
 int otherBreak(long int * pos,
-	       map<long int, vector < BamAlignment > > & supliment, 
+	       readPileUp & pileup, 
 	       string & otherside,
 	       string & bestEnd,
 	       string & bestSeqid,
@@ -922,10 +1012,12 @@ int otherBreak(long int * pos,
 	       ){
   
 #ifdef DEBUG
-  cerr << "N secondary:" << supliment.size() << endl;
+  cerr << "N secondary:" << pileup.nClusters << endl;
 #endif
 
-  if(supliment[*pos].empty()){
+  clipCluster * here = pileup.cluster(*pos);
+
+  if(here == NULL || here->supplement.empty()){
     return 0;
   }
 
@@ -935,42 +1027,31 @@ int otherBreak(long int * pos,
   cerr << "Chimeric mapping:" << endl;
 #endif
 
-  for(vector<BamAlignment>::iterator it = supliment[*pos].begin(); 
-      it != supliment[*pos].end(); it++){
+  for(vector<unsigned long>::iterator it = here->supplement.begin(); 
+      it != here->supplement.end(); it++){
 
-    string saTag;
-    if(! (*it).GetTag("SA", saTag)){
+    pileupRead & r = pileup.bySeq(*it);
+
+    if(! r.hasSA){
       cerr << "no sa\n";
       return false;
     }
-    
-#ifdef DEBUG
-    cerr << saTag << endl;
-#endif
 
-    vector<string> saInfo = split(saTag, ";");
-
-    for(vector<string>::iterator ch = saInfo.begin(); 
-	ch != saInfo.end(); ch++){
-      
-      if((*ch).empty()){
-	break;
-      }
-      
-      vector<string> chimera  = split((*ch), ",");
+    for(vector<saAlignment>::iterator sa = r.sa.begin(); 
+	sa != r.sa.end(); sa++){
 
-      vector<cigar> c;
+      string & seqid = pileup.saRefs[(*sa).ref];
 
-      burnCigar(chimera[3], c);
+#ifdef DEBUG
+      cerr << seqid << "," << (*sa).pos << "," << (*sa).strand << endl;
+#endif
 
-      if(c.front().type == 'S'){
-	otherPositions[chimera[0]][atoi(chimera[1].c_str())]++;
+      if((*sa).frontType == 'S'){
+	otherPositions[seqid][(*sa).pos]++;
       }
 
-      if(c.back().type  == 'S'){
-	long int endP = atoi(chimera[1].c_str());
-	endPos(c, &endP);
-	otherPositions[chimera[0]][endP]++;	
+      if((*sa).backType  == 'S'){
+	otherPositions[seqid][(*sa).end]++;	
       } 
     }
   }
@@ -1010,7 +1091,7 @@ int otherBreak(long int * pos,
 }
 
 bool uniqClips(long int * pos, 
-	       map<long int, vector < BamAlignment > > & clusters, 
+	       readPileUp & pileup, 
 	       vector<string> & alts, string & direction){
 
   map<string, vector<string> >  clippedSeqs;
@@ -1018,25 +1099,26 @@ bool uniqClips(long int * pos,
   int bcount = 0;
   int fcount = 0;
 
-  for( vector < BamAlignment >::iterator it = clusters[(*pos)].begin(); 
-       it != clusters[(*pos)].end(); it++){
+  clipCluster * here = pileup.cluster(*pos);
+
+  for(unsigned int i = 0; here != NULL && i < here->primary.size(); i++){
+
+    pileupRead * it = &pileup.bySeq(here->primary[i]);
     
-    if(((*it).AlignmentFlag & 0x0800) != 0 || !(*it).IsPrimaryAlignment()){
+    if((it->AlignmentFlag & 0x0800) != 0 || !it->IsPrimaryAlignment()){
       continue;
     }
     
-    vector< CigarOp > cd = (*it).CigarData;
-  
-    if((*it).Position == (*pos)){
-      string clip = (*it).QueryBases.substr(0, cd.front().Length);
+    if(it->Position == (*pos)){
+      string & clip = it->frontClip;
       if(clip.size() < 4){
 	continue;
       }
       clippedSeqs["f"].push_back(clip);
       fcount += 1;
     }
-    if((*it).GetEndPosition() == (*pos)){
-      string clip = (*it).QueryBases.substr( (*it).Length - cd.back().Length );
+    if(it->GetEndPosition() == (*pos)){
+      string & clip = it->backClip;
       if(clip.size() < 4){
 	continue;
       }
@@ -1063,6 +1145,8 @@ bool uniqClips(long int * pos,
 
 
 
+// the seqan multiple alignment, used with -m to check clipConsensus()
+
 string consensus(vector<string> & s, double * nn){
 
   if(s.empty()){
@@ -1127,7 +1211,181 @@ string consensus(vector<string> & s, double * nn){
   return con.str(); 
 }
 
+// the BCF dictionary ids of every field WHAM writes, looked up once
+
+bcfHeader bcfDict;
+
+struct bcfKeys{
+  int lrt, fe, pv, af, gc, at, cu, nc, ed, be, di;
+  int gt, gl, nr, na, dp, fr;
+} bcfKey;
+
+void initBcfKeys(void){
+  bcfKey.lrt = bcfDict.id("LRT");
+  bcfKey.fe  = bcfDict.id("FE");
+  bcfKey.pv  = bcfDict.id("PV");
+  bcfKey.af  = bcfDict.id("AF");
+  bcfKey.gc  = bcfDict.id("GC");
+  bcfKey.at  = bcfDict.id("AT");
+  bcfKey.cu  = bcfDict.id("CU");
+  bcfKey.nc  = bcfDict.id("NC");
+  bcfKey.ed  = bcfDict.id("ED");
+  bcfKey.be  = bcfDict.id("BE");
+  bcfKey.di  = bcfDict.id("DI");
+  bcfKey.gt  = bcfDict.id("GT");
+  bcfKey.gl  = bcfDict.id("GL");
+  bcfKey.nr  = bcfDict.id("NR");
+  bcfKey.na  = bcfDict.id("NA");
+  bcfKey.dp  = bcfDict.id("DP");
+  bcfKey.fr  = bcfDict.id("FR");
+}
+
+// one integer per sample in the smallest type that holds them all
+
+template <typename T>
+void bcfSampleInts(string & out, int key, const vector<T> & v, unsigned int n){
+
+  int32_t lo = 0;
+  int32_t hi = 0;
+
+  for(unsigned int i = 0; i < n; i++){
+    lo = min(lo, int32_t(v[i]));
+    hi = max(hi, int32_t(v[i]));
+  }
+
+  int type = bcfIntType(lo, hi);
+
+  bcfInt(out, key);
+  bcfTypeDescriptor(out, 1, type);
+  for(unsigned int i = 0; i < n; i++){
+    bcfPut(out, int32_t(v[i]), type);
+  }
+}
+
+// the same record as the text branch of score(), encoded as BCF 2.2
+// straight from the sample table
+
+void bcfRecord(string & out, 
+	       int contig, 
+	       long int pos, 
+	       string & altSeq, 
+	       info_field * info, 
+	       double * attributes, 
+	       int nClusters, 
+	       int nClips, 
+	       string & ends, 
+	       string & bestEnd, 
+	       string & direction,
+	       sampleTable & ti){
+
+  size_t start = out.size();
+
+  // l_shared and l_indiv, filled in at the end
+  bcfPut(out, 0, BCF_BT_INT32);
+  bcfPut(out, 0, BCF_BT_INT32);
+
+  int nInfo = globalOpts.nPermutations > 0 ? 11 : 10;
+
+  bcfPut(out, contig, BCF_BT_INT32);
+  bcfPut(out, pos, BCF_BT_INT32);
+  bcfPut(out, 1, BCF_BT_INT32);                  // rlen, REF is one base
+  bcfPut(out, BCF_FLOAT_MISSING, BCF_BT_INT32);  // QUAL
+  bcfPut(out, nInfo | (2 << 16), BCF_BT_INT32);  // alleles
+  bcfPut(out, ti.n | (6 << 24), BCF_BT_INT32);   // FORMAT fields
+
+  bcfTypeDescriptor(out, 0, BCF_BT_CHAR);        // ID
+  bcfString(out, "N", 1);
+  bcfString(out, altSeq.data(), altSeq.size());
+  bcfTypeDescriptor(out, 0, BCF_BT_NULL);        // FILTER
+
+  float v[15];
+
+  v[0] = info->lrt;
+  bcfInt(out, bcfKey.lrt);
+  bcfFloats(out, v, 1);
+
+  v[0] = info->fe;
+  bcfInt(out, bcfKey.fe);
+  bcfFloats(out, v, 1);
+
+  if(globalOpts.nPermutations > 0){
+    v[0] = info->pv;
+    bcfInt(out, bcfKey.pv);
+    bcfFloats(out, v, 1);
+  }
+
+  v[0] = info->taf;
+  v[1] = info->baf;
+  v[2] = info->aaf;
+  bcfInt(out, bcfKey.af);
+  bcfFloats(out, v, 3);
+
+  bcfInt(out, bcfKey.gc);
+  bcfTypeDescriptor(out, 2, BCF_BT_INT32);
+  bcfPut(out, int32_t(info->tgc), BCF_BT_INT32);
+  bcfPut(out, int32_t(info->bgc), BCF_BT_INT32);
+
+  for(int a = 0; a < 15; a++){
+    v[a] = attributes[a];
+  }
+  bcfInt(out, bcfKey.at);
+  bcfFloats(out, v, 15);
+
+  bcfInt(out, bcfKey.cu);
+  bcfInt(out, nClusters);
+
+  // NC is typed String in the header
+  string nc;
+  appendInt(nc, nClips);
+  bcfInt(out, bcfKey.nc);
+  bcfString(out, nc.data(), nc.size());
+
+  bcfInt(out, bcfKey.ed);
+  bcfString(out, ends.data(), ends.size());
+
+  bcfInt(out, bcfKey.be);
+  bcfString(out, bestEnd.data(), bestEnd.size());
+
+  bcfInt(out, bcfKey.di);
+  bcfString(out, direction.data(), direction.size());
+
+  size_t indiv = out.size();
+
+  // GT: unphased allele + 1, shifted left; 0 for a missing allele
+  bcfInt(out, bcfKey.gt);
+  bcfTypeDescriptor(out, 2, BCF_BT_INT8);
+  for(unsigned int t = 0; t < ti.n; t++){
+    int g = ti.genotypeIndex[t];
+    bcfPut(out, g < 0 ? 0 : (g == 2 ? 2 : 1) << 1, BCF_BT_INT8);
+    bcfPut(out, g < 0 ? 0 : (g == 0 ? 1 : 2) << 1, BCF_BT_INT8);
+  }
+
+  bcfInt(out, bcfKey.gl);
+  bcfTypeDescriptor(out, 3, BCF_BT_FLOAT);
+  for(unsigned int t = 0; t < 3 * ti.n; t++){
+    bcfPutFloat(out, ti.gls[t]);
+  }
+
+  bcfSampleInts(out, bcfKey.nr, ti.nGood,  ti.n);
+  bcfSampleInts(out, bcfKey.na, ti.nBad,   ti.n);
+  bcfSampleInts(out, bcfKey.dp, ti.nReads, ti.n);
+
+  bcfInt(out, bcfKey.fr);
+  bcfTypeDescriptor(out, 1, BCF_BT_FLOAT);
+  for(unsigned int t = 0; t < ti.n; t++){
+    float fr = 0;
+    if(ti.nClipping[t] > 0 && ti.nReads[t] > 0){
+      fr = double(ti.nClipping[t]) / double(ti.nReads[t]);
+    }
+    bcfPutFloat(out, fr);
+  }
+
+  bcfPutLength(out, start,     indiv - start - 8);
+  bcfPutLength(out, start + 4, out.size() - indiv);
+}
+
 bool score(string seqid, 
+	   int seqidIndex,
 	   long int * pos, 
 	   readPileUp & totalDat, 
 	   insertDat & localDists, 
@@ -1141,12 +1399,12 @@ bool score(string seqid,
     return true;
   }
 
-  if(totalDat.primaryCount[*pos] < 2 && totalDat.supplementCount[*pos] < 2){
+  if(totalDat.nPrimary(*pos) < 2 && totalDat.nSupplement(*pos) < 2){
     return true;
   }
 
   #ifdef DEBUG
-  cerr << "Passed Cluster filters: " << totalDat.primaryCount[*pos] << " " << totalDat.supplementCount[*pos] << endl;
+  cerr << "Passed Cluster filters: " << totalDat.nPrimary(*pos) << " " << totalDat.nSupplement(*pos) << endl;
   #endif
 
   string ends, bestEnd, bestSeqid;
@@ -1154,7 +1412,7 @@ bool score(string seqid,
   int otherBreakPointCount    = 0;
   long int otherBreakPointPos = 0;
 
-  int otherSeqids = otherBreak(pos, totalDat.supplement, ends, bestEnd, bestSeqid, &otherBreakPointCount, &otherBreakPointPos);
+  int otherSeqids = otherBreak(pos, totalDat, ends, bestEnd, bestSeqid, &otherBreakPointCount, &otherBreakPointPos);
 
   if(otherSeqids > 3){
     return true;
@@ -1184,7 +1442,7 @@ bool score(string seqid,
 
   string direction = "nan";
 
-  uniqClips(pos, totalDat.primary, alts, direction);
+  uniqClips(pos, totalDat, alts, direction);
 
   if(alts.size() < 1){
     return true;
@@ -1192,7 +1450,25 @@ bool score(string seqid,
 
   double nn   = 0;
 
-  string altSeq = consensus(alts, &nn);
+  // front clips end at the breakpoint, back clips start there
+
+  string altSeq;
+
+  consensusCache & cache = consensusCaches[omp_get_thread_num()];
+
+  // seqan may care about the order of the clips
+  bool     anchored = direction == "f";
+  uint64_t key      = consensusKey(alts, anchored, localOpts.msaConsensus);
+
+  if(! cache.find(key, alts, anchored, localOpts.msaConsensus, altSeq, &nn)){
+    if(localOpts.msaConsensus){
+      altSeq = consensus(alts, &nn);
+    }
+    else{
+      altSeq = clipConsensus(alts, anchored, &nn);
+    }
+    cache.store(key, alts, anchored, localOpts.msaConsensus, altSeq, nn);
+  }
 
   if(altSeq.size() < 11){
     return true;
@@ -1202,29 +1478,23 @@ bool score(string seqid,
     return true;
   }
 
-  map < string, indvDat*> ti;
+  sampleTable & ti = sampleTables[omp_get_thread_num()];
 
-  for(unsigned int t = 0; t < localOpts.all.size(); t++){
-    indvDat * i;
-    i = new indvDat;
-    initIndv(i);
-    ti[localOpts.all[t]] = i;
-  }
+  ti.reset();
 
   loadIndv(ti, totalDat, localOpts, localDists, pos);
 
   double nAlt = 0;
 
-  for(unsigned int t = 0; t < localOpts.all.size(); t++){
-    processGenotype(ti[localOpts.all[t]], &nAlt);
+  for(unsigned int t = 0; t < ti.n; t++){
+    processGenotype(ti, t, &nAlt);
     #ifdef DEBUG
     cerr << "position: " << *pos << endl; 
-    cerr << printIndvDat(ti[localOpts.all[t]]) << endl;
+    cerr << printIndvDat(ti, t) << endl;
     #endif 
   }
   
   if(nAlt == 0 ){
-    cleanUp(ti, localOpts);
     return true;
   }
   
@@ -1234,99 +1504,116 @@ bool score(string seqid,
 
   loadInfoField(ti, info, localOpts);
 
-  string infoToPrint = infoText(info);
-  
-  stringstream attributes;
-
-  attributes << "AT="
-	     << double(totalDat.nPaired) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nMatesMissing) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nSameStrand) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nCrossChr) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nsplitRead) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nf1SameStrand) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nf2SameStrand) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nf1f2SameStrand) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nsplitReadCrossChr) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nsplitMissingMates) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nDiscordant) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.nsameStrandDiscordant) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.ndiscordantCrossChr) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.internalInsertion) / double(totalDat.numberOfReads)
-	     << ","
-	     << double(totalDat.internalDeletion) / double(totalDat.numberOfReads)
-	     << ";";
-
-  infoToPrint.append(attributes.str());
-
-
-  stringstream tmpOutput;
-
-  tmpOutput  << seqid           << "\t"  ;       // CHROM
-  tmpOutput  << (*pos) +1       << "\t"  ;       // POS
-  tmpOutput  << "."             << "\t"  ;       // ID
-  tmpOutput  << "N"             << "\t" ;       // REF
-  tmpOutput  << altSeq          << "\t"  ;       // ALT
-  tmpOutput  << "."             << "\t"  ;       // QUAL
-  tmpOutput  << "."             << "\t"  ;       // FILTER
-  tmpOutput  << infoToPrint << ""  ;
-  tmpOutput  << "CU=" << totalDat.allCount.size() << ";"  ;
-  tmpOutput  << "NC=" << alts.size()     << ";"  ;
-  tmpOutput  << "ED=" << ends   << ";";
-  tmpOutput  << "BE=" << bestEnd << ";";
-  tmpOutput  << "DI=" << direction << "\t";
-  tmpOutput  << "GT:GL:NR:NA:DP:FR" << "\t" ;
+  if(localOpts.nPermutations > 0){
+    info->pv = permuteLRT(&ti.genotypeIndex[0], ti.n, localOpts.targetBams.size(),
+			  info->lrt, localOpts.nPermutations, siteSeed(seqid, *pos), ti.permuted);
+  }
+
+  double reads = double(totalDat.numberOfReads);
+
+  double attributes[15] = {
+    totalDat.nPaired               / reads,
+    totalDat.nMatesMissing         / reads,
+    totalDat.nSameStrand           / reads,
+    totalDat.nCrossChr             / reads,
+    totalDat.nsplitRead            / reads,
+    totalDat.nf1SameStrand         / reads,
+    totalDat.nf2SameStrand         / reads,
+    totalDat.nf1f2SameStrand       / reads,
+    totalDat.nsplitReadCrossChr    / reads,
+    totalDat.nsplitMissingMates    / reads,
+    totalDat.nDiscordant           / reads,
+    totalDat.nsameStrandDiscordant / reads,
+    totalDat.ndiscordantCrossChr   / reads,
+    totalDat.internalInsertion     / reads,
+    totalDat.internalDeletion      / reads
+  };
+
+  if(localOpts.bcf){
+    bcfRecord(results, seqidIndex, *pos, altSeq, info, attributes,
+	      totalDat.nClusters, alts.size(), ends, bestEnd, direction, ti);
+    delete info;
+    return true;
+  }
+
+  // the record goes straight into results; nothing below allocates
+  // once results has grown to its working size
+
+#ifdef DEBUG
+  size_t lineStart = results.size();
+#endif
+
+  results.append(seqid);                 // CHROM
+  results.append("\t");
+  appendInt(results, (*pos) + 1);        // POS
+  results.append("\t.\tN\t");           // ID, REF
+  results.append(altSeq);                // ALT
+  results.append("\t.\t.\t");           // QUAL, FILTER
+
+  infoText(info, results);
+
+  results.append("AT=");
+  for(int a = 0; a < 15; a++){
+    if(a > 0){
+      results.append(",");
+    }
+    appendFloat(results, attributes[a]);
+  }
+
+  results.append(";CU=");
+  appendInt(results, totalDat.nClusters);
+  results.append(";NC=");
+  appendInt(results, alts.size());
+  results.append(";ED=");
+  results.append(ends);
+  results.append(";BE=");
+  results.append(bestEnd);
+  results.append(";DI=");
+  results.append(direction);
+  results.append("\tGT:GL:NR:NA:DP:FR\t");
         
-  for(unsigned int t = 0; t < localOpts.all.size(); t++){
+  for(unsigned int t = 0; t < ti.n; t++){
 
     double fr = 0;
-    if(ti[localOpts.all[t]]->nClipping > 0 && ti[localOpts.all[t]]->nReads > 0){
-      fr = double(ti[localOpts.all[t]]->nClipping) / double(ti[localOpts.all[t]]->nReads);
+    if(ti.nClipping[t] > 0 && ti.nReads[t] > 0){
+      fr = double(ti.nClipping[t]) / double(ti.nReads[t]);
     }
 
-    tmpOutput << ti[localOpts.all[t]]->genotype 
-	      << ":" << ti[localOpts.all[t]]->gls[0]
-	      << "," << ti[localOpts.all[t]]->gls[1]
-	      << "," << ti[localOpts.all[t]]->gls[2]
-	      << ":" << ti[localOpts.all[t]]->nGood
-	      << ":" << ti[localOpts.all[t]]->nBad
-	      << ":" << ti[localOpts.all[t]]->nReads
-              << ":" << fr ;
-    if(t < localOpts.all.size() - 1){
-      tmpOutput << "\t";
+    results.append(genotypeText(ti.genotypeIndex[t]));
+    results.append(":");
+    appendFloat(results, ti.gls[3*t]);
+    results.append(",");
+    appendFloat(results, ti.gls[3*t + 1]);
+    results.append(",");
+    appendFloat(results, ti.gls[3*t + 2]);
+    results.append(":");
+    appendFloat(results, ti.nGood[t]);
+    results.append(":");
+    appendFloat(results, ti.nBad[t]);
+    results.append(":");
+    appendInt(results, ti.nReads[t]);
+    results.append(":");
+    appendFloat(results, fr);
+    if(t < ti.n - 1){
+      results.append("\t");
     }
   }
   
-  tmpOutput << endl;
+  results.append("\n");
 
   #ifdef DEBUG
-  cerr << "line: " << tmpOutput.str();
+  cerr << "line: " << results.substr(lineStart);
   #endif 
   
-  results.append(tmpOutput.str());
-  
-  cleanUp(ti, localOpts);
-  
   delete info;
   
   return true;
 }
 
 
-bool filt(BamAlignment & al){
+// checks on the fixed fields only, before any strings are built
+
+bool filtCore(BamAlignment & al){
 
   if(!al.IsMapped()){
     return false;
@@ -1341,12 +1628,15 @@ bool filt(BamAlignment & al){
      && ((al.AlignmentFlag & 0x0800) == 0)){
     return false;
   }
+  return true;
+}
+
+bool filtChars(BamAlignment & al){
 
-  string xaTag;
+  strView xaTag;
   
-  if(al.GetTag("XA", xaTag)){
-    vector<string> xas = split(xaTag, ";");
-      if(xas.size() > 2){
+  if(findStringTag(al.TagData, "XA", xaTag)){
+      if(countFields(xaTag, ';') > 2){
 	return false;
       }
   }
@@ -1357,52 +1647,640 @@ bool filt(BamAlignment & al){
 
   return true;
 }
+
+// most reads fail on flags or mapping quality, so name, bases and tags
+// are only decoded for reads that pass filtCore
+
+bool filt(bamMultiStream * All, BamAlignment & al){
+  return filtCore(al) && All->buildCharData(al) && filtChars(al);
+}
  
-bool runRegion(int seqidIndex, int start, int end, vector< RefData > seqNames){
-  
-  string regionResults;
+void printReadRates(double seconds){
 
-  omp_set_lock(&lock);
+  long int decoded = readers->nDecoded();
+  long int built   = readers->nBuilt();
 
-  global_opts localOpts = globalOpts;
-  insertDat localDists = insertDists;
+  if(seconds <= 0){
+    seconds = 1;
+  }
 
-  omp_unset_lock(&lock);
+  cerr << "INFO: decoded " << decoded << " reads ("
+       << decoded / seconds << " per second), built strings and tags for "
+       << built << " (" << built / seconds << " per second)" << endl;
+}
 
-  BamMultiReader All;
-  
-  prepBams(All, "all");
+void printConsensusHits(void){
 
-  if(!All.SetRegion(seqidIndex, start, seqidIndex, end)){
-    return false;
-  }
+  long int hits   = 0;
+  long int misses = 0;
 
-  BamAlignment al     ;
-  readPileUp allPileUp;
+  for(vector<consensusCache>::iterator c = consensusCaches.begin(); c != consensusCaches.end(); c++){
+    hits   += (*c).nHits;
+    misses += (*c).nMisses;
+  }
 
-  if(! All.GetNextAlignment(al)){
-    All.Close();
-    return false;
+  cerr << "INFO: consensus cache hits, misses : " << hits << ", " << misses;
+  if(hits + misses > 0){
+    cerr << " (" << 100.0 * hits / (hits + misses) << "% reused)";
   }
+  cerr << endl;
+}
 
-  long int currentPos = 0;
-  bool getNextAl      = true;
+// a record of a region not yet handed to the writer: where it was
+// scored and its bytes in regionOutput::text
 
-  while(1){  
-  
+struct pendingRecord{
+  long int pos  ;
+  size_t   begin;
+  size_t   end  ;
+  bool operator<(const pendingRecord & o) const { return pos < o.pos; }
+};
+
+// score() does not visit positions in order: a read clipped at its end
+// is scored at its end position.  Records are held until the reads left
+// to come can no longer produce an earlier position.
+
+struct regionOutput{
+  long int number;
+  long int start ;
+  long int end   ;
+  string   text  ;
+  vector<pendingRecord> records;
+  string   ready ;
+  string   spare ; // the next text, keeps its capacity
+  int      seqidIndex;
+  vector<outputRecord> indexed; // the records in ready
+  bool     hold  ; // keep ready until the seam with the left is checked
+};
+
+// hands the records before bound to the writer in position order (ties
+// in the order they were scored).  Records outside [start, end], the
+// bounds the reads were fetched with, are dropped: they fall to a
+// neighbouring region and would break the order.
+
+void releaseRecords(regionOutput & r, long int bound){
+
+  if(r.records.empty()){
+    return;
+  }
+
+  stable_sort(r.records.begin(), r.records.end());
+
+  string & kept = r.spare;
+
+  vector<pendingRecord>::iterator rec = r.records.begin();
+
+  for(; rec != r.records.end() && (*rec).pos < bound; rec++){
+    if((*rec).pos >= r.start && (*rec).pos <= r.end){
+      // REF is a single base
+      outputRecord o;
+      o.ref     = r.seqidIndex;
+      o.beg     = (*rec).pos;
+      o.end     = (*rec).pos + 1;
+      o.textBeg = r.ready.size();
+      r.ready.append(r.text, (*rec).begin, (*rec).end - (*rec).begin);
+      o.textEnd = r.ready.size();
+      r.indexed.push_back(o);
+    }
+  }
+
+  if(rec == r.records.begin()){
+    return;
+  }
+
+  kept.clear();
+
+  unsigned int n = 0;
+
+  for(; rec != r.records.end(); rec++){
+    size_t length = (*rec).end - (*rec).begin;
+    size_t begin  = kept.size();
+    kept.append(r.text, (*rec).begin, length);
+    r.records[n].pos   = (*rec).pos;
+    r.records[n].begin = begin;
+    r.records[n].end   = begin + length;
+    n++;
+  }
+
+  r.records.resize(n);
+  r.text.swap(kept);
+
+  if(!r.hold){
+    output.submit(r.ready, r.number, r.indexed);
+  }
+}
+
+void printOutputHeld(void){
+  cerr << "INFO: output held back for ordering peaked at " << output.maxHeld / 1048576.0
+       << " MB, " << output.nSpilled / 1048576.0 << " MB went to a temporary file" << endl;
+}
+
+// a region still running past either budget while a thread has nothing
+// to do is split: it stops a little way on and hands what is left back
+// to the queue, in pieces no shorter than REGION_MIN_SPLIT bases
+
+#define REGION_BUDGET_SECONDS 30
+#define REGION_BUDGET_READS   2000000
+#define REGION_MIN_SPLIT      10000
+#define REGION_MIN_HALO       1000
+#define REGION_CHECK_READS    4096
+
+// regions waiting to run, costliest first, with the pieces of split
+// regions put in front.  A thread out of work sleeps on workReady while
+// others still run, since they may hand some back; anything that queues
+// work or finishes the last running region wakes it.
+
+class regionQueue {
+
+ public:
+
+  deque<regionDat *> waiting;
+  int        running   ;
+  int        idle      ;
+  long int   nextNumber; // for the pieces of split regions
+  long int   nSplit    ;
+  long int   nRerun    ;
+
+  std::mutex              qLock    ;
+  std::condition_variable workReady;
+
+  regionQueue(){
+    running    = 0;
+    idle       = 0;
+    nextNumber = 0;
+    nSplit     = 0;
+    nRerun     = 0;
+  }
+
+  bool next(regionDat **);
+  void done(void);
+};
+
+regionQueue queue;
+
+bool regionQueue::next(regionDat ** r){
+
+  std::unique_lock<std::mutex> guard(qLock);
+
+  if(waiting.empty() && running > 0){
+    idle += 1;
+    while(waiting.empty() && running > 0){
+      workReady.wait(guard);
+    }
+    idle -= 1;
+  }
+
+  if(waiting.empty()){
+    return false;
+  }
+
+  *r = waiting.front();
+  waiting.pop_front();
+  running += 1;
+
+  return true;
+}
+
+void regionQueue::done(void){
+  std::lock_guard<std::mutex> guard(qLock);
+  running -= 1;
+  if(running == 0){
+    workReady.notify_all();
+  }
+}
+
+// estimated work of [start, end], from the index of every BAM; 0 only
+// when no BAM has a chunk to read there.  The indices were loaded by
+// grabInsertLengths().
+
+uint64_t regionCost(int seqidIndex, long int start, long int end){
+  uint64_t cost = 0;
+  for(vector<string>::iterator f = globalOpts.all.begin(); f != globalOpts.all.end(); f++){
+    cost += indexCache.get(*f)->span(seqidIndex, start, end + 1);
+  }
+  return cost;
+}
+
+bool regionCostlier(regionDat * a, regionDat * b){
+  return a->cost > b->cost;
+}
+
+// cuts [beg, end] into at most n pieces of about equal cost, by 16kb
+// window, none shorter than minLength.  The starts of all pieces but
+// the first go to cuts.
+
+void costCuts(int seqidIndex, int beg, int end, int n, int minLength, vector<int> & cuts){
+
+  cuts.clear();
+
+  if(n < 2 || end - beg + 1 < 2 * minLength){
+    return;
+  }
+
+  int window = 1 << BAI_LINEAR_SHIFT;
+
+  vector<uint64_t> costs;
+  uint64_t total = 0;
+
+  for(long int w = beg; w <= end; w += window){
+    // empty windows count a little, so reads spread evenly cut by length
+    costs.push_back(regionCost(seqidIndex, w, min(w + window - 1, (long int) end)) + 1);
+    total += costs.back();
+  }
+
+  uint64_t sum  = 0;
+  int      last = beg;
+  int      k    = 1;
+
+  for(unsigned int i = 0; i + 1 < costs.size() && k < n; i++){
+    sum += costs[i];
+    int cut = beg + (i + 1) * window;
+    if(sum * n >= total * k && cut - last >= minLength && end + 1 - cut >= minLength){
+      cuts.push_back(cut);
+      last = cut;
+      k    = sum * n / total + 1;
+    }
+  }
+}
+
+// reads taken so far at the position of the last one.  Two scans that
+// took the same reads from the same position agree on it, which tells
+// apart identical looking reads at one spot.
+
+struct scanState{
+  long int pos   ;
+  long int nAtPos;
+};
+
+bool nextRead(bamMultiStream * All, BamAlignment & al, scanState & scan){
+  if(! All->getNextAlignmentCore(al)){
+    return false;
+  }
+  if(al.Position != scan.pos){
+    scan.pos    = al.Position;
+    scan.nAtPos = 0;
+  }
+  scan.nAtPos += 1;
+  return true;
+}
+
+// everything the rest of a scan depends on: the pileup, the read last
+// taken (only its core is decoded for sure) and where reads are added
+
+uint64_t statePrint(readPileUp & pileup,
+		    BamAlignment & al,
+		    uint16_t sample,
+		    scanState & scan,
+		    long int currentPos,
+		    bool getNextAl){
+
+  uint64_t h = pileup.fingerprint();
+
+  h = mixPrint(h, ((uint64_t)(uint32_t) al.Position << 32) | (uint32_t) al.MatePosition);
+  h = mixPrint(h, ((uint64_t) al.AlignmentFlag << 32) | ((uint64_t) sample << 8) | al.MapQuality);
+  h = mixPrint(h, (uint32_t) al.InsertSize);
+  h = mixPrint(h, scan.nAtPos);
+  h = mixPrint(h, currentPos);
+  h = mixPrint(h, getNextAl);
+
+  return h;
+}
+
+// the first state of the right scan that the left scan also passed
+// through; the right scan matches an unsplit one from that step on
+
+bool seamMatch(regionSeam * seam, vector<seamPoint> & head, long int * synced){
+  for(vector<seamPoint>::iterator h = head.begin(); h != head.end(); h++){
+    if(binary_search(seam->tail.begin(), seam->tail.end(), (*h).print)){
+      *synced = (*h).step;
+      return true;
+    }
+  }
+  return false;
+}
+
+// the region after a seam that did not match runs again from where the
+// region before it started reading, so it repeats that scan and goes on
+// past the seam.  Under the queue lock.
+
+void rerunRegion(regionDat * r, regionSeam * seam){
+
+  r->fetchStart = seam->leftFetch;
+  r->synced     = seam->leftSynced;
+  r->left       = NULL;
+
+  r->head.clear();
+  r->tail.clear();
+  r->ready.clear();
+  r->indexed.clear();
+
+  delete seam;
+
+  queue.nRerun += 1;
+  queue.waiting.push_front(r);
+  queue.workReady.notify_one();
+}
+
+// hands the states of a checked region to the seam after it.  A region
+// there that finished first is checked now, and if it matches it is
+// written and its own states go on to the next seam.  Under the queue
+// lock.
+
+void publishTail(regionDat * r, vector<seamPoint> & tail){
+
+  while(r->right != NULL){
+
+    regionSeam * seam = r->right;
+
+    seam->tail.clear();
+    for(vector<seamPoint>::iterator t = tail.begin(); t != tail.end(); t++){
+      if((*t).step >= r->synced){
+	seam->tail.push_back((*t).print);
+      }
+    }
+    sort(seam->tail.begin(), seam->tail.end());
+
+    seam->leftDone   = true;
+    seam->leftFetch  = r->fetchStart;
+    seam->leftSynced = r->synced;
+
+    regionDat * p = seam->parked;
+
+    if(p == NULL){
+      return;
+    }
+
+    if(! seamMatch(seam, p->head, &p->synced)){
+      rerunRegion(p, seam);
+      return;
+    }
+
+    delete seam;
+
+    r->right = NULL;
+    p->left  = NULL;
+    output.submit(p->ready, p->number, p->indexed);
+    output.close(p->number, p->next);
+
+    r = p;
+    tail.swap(p->tail);
+  }
+}
+
+// checks a region against the seam before it, if the left scan is done.
+// A region that does not match is queued to run again and false comes
+// back; it must not be touched after that.
+
+bool checkLeft(regionDat * r, vector<seamPoint> & head, regionOutput & results){
+
+  queue.qLock.lock();
+
+  regionSeam * seam = r->left;
+
+  if(! seam->leftDone){
+    queue.qLock.unlock();
+    return true;
+  }
+
+  if(! seamMatch(seam, head, &r->synced)){
+    rerunRegion(r, seam);
+    queue.qLock.unlock();
+    return false;
+  }
+
+  delete seam;
+  r->left = NULL;
+
+  queue.qLock.unlock();
+
+  results.hold = false;
+  output.submit(results.ready, results.number, results.indexed);
+
+  return true;
+}
+
+// stops a region a little way on and queues the rest in pieces, each
+// with its own seam.  The stop is past the halo and past every record
+// scored so far, so the left scan can keep the states the pieces will
+// be checked against.
+
+void splitRegion(regionDat * r, regionOutput & results, long int position, long int farthest, int longest, vector< RefData > & seqNames){
+
+  int halo      = max(REGION_MIN_HALO, 4 * longest);
+  int cut       = max(position + 2 * halo, farthest + 1);
+  int minLength = max(REGION_MIN_SPLIT, 4 * halo);
+
+  if(r->end + 1 - cut < minLength){
+    return;
+  }
+
+  queue.qLock.lock();
+  int pieces = queue.idle;
+  queue.qLock.unlock();
+
+  if(pieces == 0){
+    return;
+  }
+
+  vector<int> cuts;
+
+  costCuts(r->seqidIndex, cut, r->end, pieces, minLength, cuts);
+
+  cuts.insert(cuts.begin(), cut);
+
+  queue.qLock.lock();
+
+  vector<regionDat *> split;
+
+  regionDat * before = r;
+
+  for(unsigned int c = 0; c < cuts.size(); c++){
+
+    regionSeam * seam = new regionSeam;
+    seam->halo       = halo;
+    seam->from       = cuts[c] - halo;
+    seam->leftDone   = false;
+    seam->leftFetch  = 0;
+    seam->leftSynced = 0;
+    seam->parked     = NULL;
+
+    regionDat * piece = new regionDat;
+    piece->seqidIndex = r->seqidIndex;
+    piece->start      = cuts[c];
+    piece->end        = c + 1 < cuts.size() ? cuts[c + 1] - 1 : r->end;
+    piece->number     = queue.nextNumber++;
+    piece->cost       = 0;
+    piece->next       = before->next;
+    piece->fetchStart = cuts[c] - halo;
+    piece->fetchEnd   = r->fetchEnd;
+    piece->synced     = 0;
+    piece->left       = seam;
+    piece->right      = before->right;
+
+    before->next  = piece->number;
+    before->right = seam;
+    before        = piece;
+
+    split.push_back(piece);
+  }
+
+  r->end = cut - 1;
+
+  queue.nSplit += 1;
+  queue.waiting.insert(queue.waiting.begin(), split.begin(), split.end());
+  queue.workReady.notify_all();
+
+  queue.qLock.unlock();
+
+  results.end = r->end;
+
+  omp_set_lock(&::lock);
+  cerr << "INFO: split region: " << seqNames[r->seqidIndex].RefName << ":" << cut
+       << "-" << split.back()->end << " into " << split.size() << endl;
+  omp_unset_lock(&::lock);
+}
+
+// writes a finished region, or leaves it with the seam before it until
+// the region there is done
+
+void finishRegion(regionDat * r, regionOutput & results, vector<seamPoint> & head, vector<seamPoint> & tail){
+
+  if(r->left != NULL){
+
+    queue.qLock.lock();
+
+    regionSeam * seam = r->left;
+
+    if(! seam->leftDone){
+      r->head.swap(head);
+      r->tail.swap(tail);
+      r->ready.swap(results.ready);
+      r->indexed.swap(results.indexed);
+      seam->parked = r;
+      queue.qLock.unlock();
+      return;
+    }
+
+    if(! seamMatch(seam, head, &r->synced)){
+      rerunRegion(r, seam);
+      queue.qLock.unlock();
+      return;
+    }
+
+    delete seam;
+    r->left = NULL;
+
+    queue.qLock.unlock();
+  }
+
+  output.submit(results.ready, results.number, results.indexed);
+  output.close(r->number, r->next);
+
+  queue.qLock.lock();
+  publishTail(r, tail);
+  queue.qLock.unlock();
+}
+
+bool runRegion(regionDat * region, vector< RefData > seqNames){
+
+  int seqidIndex = region->seqidIndex;
+  
+  regionOutput regionResults;
+
+  regionResults.number     = region->number;
+  regionResults.seqidIndex = seqidIndex;
+  regionResults.start      = region->start;
+  regionResults.end        = region->end;
+  regionResults.hold       = region->left != NULL;
+
+  omp_set_lock(&::lock);
+
+  global_opts localOpts = globalOpts;
+  insertDat localDists = insertDists;
+
+  omp_unset_lock(&::lock);
+
+  bamMultiStream * All = readers->region(seqidIndex, region->fetchStart, region->fetchEnd);
+
+  BamAlignment al     ;
+  readPileUp allPileUp;
+  scanState  scan     ;
+
+  scan.pos    = -1;
+  scan.nAtPos = 0;
+
+  bool ok = All != NULL && nextRead(All, al, scan);
+
+  long int currentPos = 0;
+  bool getNextAl      = ok;
+
+  // for splitting and for checking split regions
+
+  double   began     = omp_get_wtime();
+  long int firstCore = ok ? All->nCore : 0;
+  long int nextCheck = firstCore + REGION_CHECK_READS;
+  long int step      = 0;
+  long int farthest  = -1;    // of any record
+  bool     owned     = false; // a record in [start, end] was scored
+
+  vector<seamPoint> head;
+  vector<seamPoint> tail;
+
+  while(1){  
+  
     bool clipped = false;
     
     if(getNextAl == false){
       break;
     }
     
+    if(region->left != NULL || region->right != NULL){
+
+      // before fetchStart the right scan may lack reads the left one has
+      bool keepHead = region->left != NULL && ! owned
+	&& al.Position >= region->fetchStart
+	&& al.Position <= region->start + region->left->halo;
+      bool keepTail = region->right != NULL && farthest <= region->end
+	&& al.Position >= region->right->from;
+
+      if(keepHead || keepTail){
+	seamPoint here;
+	here.step  = step;
+	here.print = statePrint(allPileUp, al, All->sample(), scan, currentPos, getNextAl);
+	if(keepHead){
+	  head.push_back(here);
+	}
+	if(keepTail){
+	  tail.push_back(here);
+	}
+      }
+    }
+
+    // reads are fetched to the end of the reference, so the scan up to
+    // here is the one an unsplit run makes.  Every later record is at or
+    // past al, which belongs to the next region.
+    if(al.Position > region->end){
+      break;
+    }
+
+    // the clock is read once every REGION_CHECK_READS reads.  A region
+    // run again from an earlier start splits only once it is past it.
+    if(region->left == NULL && owned && All->nCore >= nextCheck){
+      nextCheck = All->nCore + REGION_CHECK_READS;
+      if(omp_get_wtime() - began > REGION_BUDGET_SECONDS || All->nCore - firstCore > REGION_BUDGET_READS){
+	splitRegion(region, regionResults, al.Position, farthest, allPileUp.longest, seqNames);
+      }
+    }
+
+    step += 1;
+
     while(clipped == false && getNextAl){
       
-      getNextAl = All.GetNextAlignment(al);
+      getNextAl = nextRead(All, al, scan);
       
-      if(filt(al)){
+      if(filt(All, al)){
 	    	
-	vector< CigarOp > cd = al.CigarData;
+	const vector< CigarOp > & cd = al.CigarData;
 	
 	if(cd.front().Type == 'S' ){
 	  currentPos = al.Position;
@@ -1414,14 +2292,14 @@ bool runRegion(int seqidIndex, int start, int end, vector< RefData > seqNames){
           clipped = true;
 	}
 
-	allPileUp.processAlignment(al, currentPos);
+	allPileUp.processAlignment(al, currentPos, All->sample());
 
        	while(al.Position <= currentPos && getNextAl && clipped){
-	  getNextAl = All.GetNextAlignment(al);
+	  getNextAl = nextRead(All, al, scan);
 	  
-	  if( filt(al) && getNextAl){
+	  if( getNextAl && filt(All, al)){
 	    
-	    allPileUp.processAlignment(al, currentPos);
+	    allPileUp.processAlignment(al, currentPos, All->sample());
 	  }
 	}
       }	
@@ -1433,36 +2311,57 @@ bool runRegion(int seqidIndex, int start, int end, vector< RefData > seqNames){
 
     allPileUp.purgePast();    
 
+    size_t before = regionResults.text.size();
+
     if(! score(seqNames[seqidIndex].RefName, 
+	       seqidIndex,
 	       &currentPos, 
 	       allPileUp,
 	       localDists, 
-	       regionResults, 
+	       regionResults.text, 
 	       localOpts )){
       cerr << "FATAL: problem during scoring" << endl;
       cerr << "FATAL: wham exiting"           << endl;
       exit(1);
     }
+
+    if(regionResults.text.size() > before){
+      pendingRecord rec;
+      rec.pos   = currentPos;
+      rec.begin = before;
+      rec.end   = regionResults.text.size();
+      regionResults.records.push_back(rec);
+
+      farthest = max(farthest, currentPos);
+
+      if(! owned && currentPos >= region->start && currentPos <= region->end){
+	owned = true;
+	if(region->left != NULL && ! checkLeft(region, head, regionResults)){
+	  return true;
+	}
+      }
+    }
+
+    // reads come sorted and every later position is at or past the
+    // start of al, which is the next read to be added
     
-    if(regionResults.size() > 100000){
-      omp_set_lock(&lock);
-      cout << regionResults;
-      omp_unset_lock(&lock);
-      regionResults.clear(); 
+    if(regionResults.text.size() > 100000){
+      releaseRecords(regionResults, getNextAl ? al.Position : LONG_MAX);
     }
   }
 
-  omp_set_lock(&lock);
+  releaseRecords(regionResults, LONG_MAX);
 
-  cout << regionResults;
+  finishRegion(region, regionResults, head, tail);
 
-  omp_unset_lock(&lock);
-  
-  regionResults.clear();
-  
-  All.Close();
+  return ok;
+}
 
-  return true;
+bool regionBefore(regionDat * a, regionDat * b){
+  if(a->seqidIndex != b->seqidIndex){
+    return a->seqidIndex < b->seqidIndex;
+  }
+  return a->start < b->start;
 }
 
 bool loadBed(vector<regionDat*> & features, RefVector seqs){
@@ -1510,11 +2409,14 @@ int main(int argc, char** argv) {
   cerr << "INFO: WHAM is in debug mode" << endl;
 #endif
 
-  omp_init_lock(&lock);
+  omp_init_lock(&::lock);
 
   srand((unsigned)time(NULL));
 
   globalOpts.nthreads = -1;
+  globalOpts.ninflaters = 2;
+  globalOpts.msaConsensus = false;
+  globalOpts.nPermutations = 0;
 
   parseOpts(argc, argv);
   
@@ -1528,6 +2430,12 @@ int main(int argc, char** argv) {
   globalOpts.all.insert( globalOpts.all.end(), globalOpts.targetBams.begin(), globalOpts.targetBams.end() );
   globalOpts.all.insert( globalOpts.all.end(), globalOpts.backgroundBams.begin(), globalOpts.backgroundBams.end() );
 
+  // reads carry their sample as a 16 bit index into globalOpts.all
+  if(globalOpts.all.size() > 65535){
+    cerr << "FATAL: no more than 65535 bams are supported." << endl;
+    exit(1);
+  }
+
   BamMultiReader allReader;
   
 
@@ -1553,7 +2461,47 @@ int main(int argc, char** argv) {
   RefVector sequences = allReader.GetReferenceData();
   allReader.Close();
 
-  printHeader();
+  stringstream header;
+  printHeader(header, sequences);
+
+  readers = new readerPool(globalOpts.all);
+
+  initMapqGL();
+
+  consensusCaches.resize(omp_get_max_threads());
+
+  // every allele count an association test can see
+  logFactorial.init(2 * globalOpts.all.size() + 2);
+
+  sampleTables.resize(omp_get_max_threads());
+  for(vector<sampleTable>::iterator st = sampleTables.begin(); st != sampleTables.end(); st++){
+    (*st).resize(globalOpts.all.size());
+  }
+
+  inflaters.start(globalOpts.ninflaters);
+
+  // from here on only the writer thread touches the output
+
+  if(globalOpts.output == "NA"){
+    output.start(cout, header.str());
+  }
+  else{
+    vector<string> refNames;
+    for(vector< RefData >::iterator sit = sequences.begin(); sit != sequences.end(); sit++){
+      refNames.push_back((*sit).RefName);
+    }
+    string start = header.str();
+    if(globalOpts.bcf){
+      bcfDict.parse(start);
+      initBcfKeys();
+      start.clear();
+      bcfDict.bytes(header.str(), start);
+    }
+    if(! output.start(globalOpts.output, refNames, start, globalOpts.bcf)){
+      cerr << "FATAL: could not open output file: " << globalOpts.output << endl;
+      exit(1);
+    }
+  }
 
   int seqidIndex = 0;
 
@@ -1566,16 +2514,18 @@ int main(int argc, char** argv) {
     }
   }
 
+  double startTime = omp_get_wtime();
+
+  vector< regionDat* > regions; 
+
   if(seqidIndex != 0 || globalOpts.region.size() == 2 ){
-    if(! runRegion(seqidIndex, globalOpts.region[0], globalOpts.region[1], sequences)){
-      cerr << "WARNING: region failed to run properly." << endl;
-    }
-    cerr << "INFO: WHAM-BAM finished normally." << endl;
-    return 0;
+    regionDat * r = new regionDat;
+    r->seqidIndex = seqidIndex;
+    r->start      = globalOpts.region[0];
+    r->end        = globalOpts.region[1];
+    regions.push_back(r);
   }
-  
-  vector< regionDat* > regions; 
-  if(globalOpts.bed == "NA"){
+  else if(globalOpts.bed == "NA"){
     for(vector< RefData >::iterator sit = sequences.begin(); sit != sequences.end(); sit++){
       int start = 500;
       if((*sit).RefLength < 2000){
@@ -1604,29 +2554,102 @@ int main(int argc, char** argv) {
     loadBed(regions, sequences);
   }
 
- #pragma omp parallel for
-  
-  for(unsigned int re = 0; re < regions.size(); re++){
-
-    omp_set_lock(&lock);
-    cerr << "INFO: running region: " << sequences[regions[re]->seqidIndex].RefName << ":" << regions[re]->start << "-" << regions[re]->end << endl;
-    omp_unset_lock(&lock);
-
-    if(! runRegion( regions[re]->seqidIndex, regions[re]->start, regions[re]->end, sequences)){
-      omp_set_lock(&lock);
-      cerr << "WARNING: region failed to run properly: " 
-	   << sequences[regions[re]->seqidIndex].RefName 
-	   << ":"  << regions[re]->start << "-" 
-	   << regions[re]->end 
-	   <<  endl;
-      omp_unset_lock(&lock);
+  // regions are written in genomic order, so they are numbered in it.
+  // Regions with nothing to read in any BAM are dropped.  Neighbouring
+  // chunks share a base, as do touching BED lines; the region before
+  // keeps the records there, since its scan runs on past its end, and
+  // the one after still reads from its own start.
+
+  stable_sort(regions.begin(), regions.end(), regionBefore);
+
+  vector< regionDat* > work;
+  uint64_t totalCost = 0;
+
+  for(vector< regionDat* >::iterator r = regions.begin(); r != regions.end(); r++){
+    (*r)->cost = regionCost((*r)->seqidIndex, (*r)->start, (*r)->end);
+    if((*r)->cost == 0){
+      delete *r;
+      continue;
+    }
+    (*r)->fetchStart = (*r)->start;
+    (*r)->fetchEnd   = sequences[(*r)->seqidIndex].RefLength;
+    if(! work.empty() && work.back()->seqidIndex == (*r)->seqidIndex
+       && work.back()->end >= (*r)->start){
+      (*r)->start = work.back()->end + 1;
+      if((*r)->start > (*r)->end){
+	delete *r;
+	continue;
+      }
     }
+    (*r)->number     = work.size();
+    (*r)->next       = work.size() + 1;
+    (*r)->synced     = 0;
+    (*r)->left       = NULL;
+    (*r)->right      = NULL;
+    totalCost       += (*r)->cost;
+    work.push_back(*r);
+  }
+
+  cerr << "INFO: " << work.size() << " of " << regions.size() << " regions have reads to fetch, "
+       << totalCost / 1048576.0 << " MB of compressed BAM" << endl;
+
+  // the costliest regions go first and the rest are handed out one at a
+  // time as threads free up, so no thread starts a big region late.  The
+  // writer holds finished regions until those before them are done.
+
+  stable_sort(work.begin(), work.end(), regionCostlier);
 
+  queue.waiting.assign(work.begin(), work.end());
+  queue.nextNumber = work.size();
+
+ #pragma omp parallel
+  {
+    regionDat * r;
+
+    while(queue.next(&r)){
+
+      omp_set_lock(&::lock);
+      cerr << "INFO: running region: " << sequences[r->seqidIndex].RefName << ":" << r->start << "-" << r->end << endl;
+      omp_unset_lock(&::lock);
+
+      // a split region changes its end while it runs
+      int seqid = r->seqidIndex;
+      int start = r->start;
+      int end   = r->end;
+
+      if(! runRegion(r, sequences)){
+	omp_set_lock(&::lock);
+	cerr << "WARNING: region failed to run properly: " 
+	     << sequences[seqid].RefName 
+	     << ":"  << start << "-" 
+	     << end 
+	     <<  endl;
+	omp_unset_lock(&::lock);
+      }
+      queue.done();
+    }
   }
 
+  cerr << "INFO: " << queue.nSplit << " long running regions were split, "
+       << queue.nRerun << " pieces ran again from an earlier start" << endl;
+
     //    (*chunk) = NULL;
     //    delete (*chunk);
 
+  cerr << "INFO: " << readers->nOpened() << " readers served " << readers->nServed()
+       << " regions, saving " << readers->nSaved() << " BAM opens" << endl;
+  cerr << "INFO: shared BAM indices use " << indexCache.bytes() / 1048576.0
+       << " MB, per thread copies would have used "
+       << (indexCache.bytes() * readers->nOpened()) / 1048576.0 << " MB" << endl;
+
+  output.stop();
+  printOutputHeld();
+
+  printReadRates(omp_get_wtime() - startTime);
+  printConsensusHits();
+
+  delete readers;
+  inflaters.stop();
 
   cerr << "INFO: WHAM-BAM finished normally." << endl;
   return 0;
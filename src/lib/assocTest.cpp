@@ -0,0 +1,242 @@
+//
+//  assocTest.cpp
+//  wham
+//
+
+#include "assocTest.h"
+
+#include <math.h>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+logFactorials logFactorial;
+
+void logFactorials::init(unsigned int n){
+  table.resize(n + 1);
+  for(unsigned int k = 0; k <= n; k++){
+    table[k] = lgamma(double(k) + 1);
+  }
+}
+
+double logFactorials::slow(int k) const {
+  return lgamma(double(k) + 1);
+}
+
+// a no call (-1) masks its lane out of both sums
+
+void countAlleles(const int * g, unsigned int n, int * nCalled, int * nAlt){
+
+  unsigned int j      = 0;
+  int          called = 0;
+  int          alt    = 0;
+
+#if defined(__AVX2__)
+  __m256i none  = _mm256_set1_epi32(-1);
+  __m256i sumC  = _mm256_setzero_si256();
+  __m256i sumA  = _mm256_setzero_si256();
+
+  for(; j + 8 <= n; j += 8){
+    __m256i gi = _mm256_loadu_si256((const __m256i *)(g + j));
+    __m256i ok = _mm256_cmpgt_epi32(gi, none);
+    sumA = _mm256_add_epi32(sumA, _mm256_and_si256(gi, ok));
+    sumC = _mm256_sub_epi32(sumC, ok);
+  }
+
+  int c8[8], a8[8];
+  _mm256_storeu_si256((__m256i *) c8, sumC);
+  _mm256_storeu_si256((__m256i *) a8, sumA);
+  for(int l = 0; l < 8; l++){
+    called += c8[l];
+    alt    += a8[l];
+  }
+#endif
+
+#if defined(__SSE2__)
+  __m128i none4 = _mm_set1_epi32(-1);
+  __m128i sumC4 = _mm_setzero_si128();
+  __m128i sumA4 = _mm_setzero_si128();
+
+  for(; j + 4 <= n; j += 4){
+    __m128i gi = _mm_loadu_si128((const __m128i *)(g + j));
+    __m128i ok = _mm_cmpgt_epi32(gi, none4);
+    sumA4 = _mm_add_epi32(sumA4, _mm_and_si128(gi, ok));
+    sumC4 = _mm_sub_epi32(sumC4, ok);
+  }
+
+  int c4[4], a4[4];
+  _mm_storeu_si128((__m128i *) c4, sumC4);
+  _mm_storeu_si128((__m128i *) a4, sumA4);
+  for(int l = 0; l < 4; l++){
+    called += c4[l];
+    alt    += a4[l];
+  }
+#endif
+
+  for(; j < n; j++){
+    if(g[j] >= 0){
+      called += 1;
+      alt    += g[j];
+    }
+  }
+
+  *nCalled = called;
+  *nAlt    = alt;
+}
+
+double logBinomial(int x, int n, double p){
+  return logFactorial(n) - logFactorial(x) - logFactorial(n - x) + x * log(p) + (n - x) * log(1 - p);
+}
+
+double allelicLRT(int nCalledA, int nAltA, int nCalledB, int nAltB, double * af){
+
+  int nA = 2 * nCalledA;
+  int nB = 2 * nCalledB;
+
+  af[0] = 0.000001 + double(nAltA) / double(nA);
+  af[1] = 0.000001 + double(nAltB) / double(nB);
+  af[2] = 0.000001 + double(nAltA + nAltB) / double(nA + nB);
+
+  double alt  = logBinomial(nAltA, nA, af[0]) + logBinomial(nAltB, nB, af[1]);
+  double null = logBinomial(nAltA, nA, af[2]) + logBinomial(nAltB, nB, af[2]);
+
+  return 2 * (alt - null);
+}
+
+// log probability of x in the top left cell given the margins
+
+static double logHypergeometric(int x, int r1, int r2, int c1){
+  int c2 = r1 + r2 - c1;
+  return logFactorial(r1) + logFactorial(r2) + logFactorial(c1) + logFactorial(c2)
+    - logFactorial(r1 + r2) - logFactorial(x) - logFactorial(r1 - x)
+    - logFactorial(c1 - x) - logFactorial(r2 - c1 + x);
+}
+
+// the probabilities fall off on both sides of the mode, so they are
+// walked outwards from it relative to the mode, by the ratio of
+// neighbouring terms, until what is left cannot change the sum
+
+double fisherExact(int a, int b, int c, int d){
+
+  int r1 = a + b;
+  int r2 = c + d;
+  int c1 = a + c;
+  int n  = r1 + r2;
+
+  if(n == 0){
+    return 1;
+  }
+
+  int lo = max(0, c1 - r2);
+  int hi = min(r1, c1);
+
+  int mode = int(floor((double(r1) + 1) * (double(c1) + 1) / (double(n) + 2)));
+  mode = min(max(mode, lo), hi);
+
+  // ties within rounding count as no more likely
+  double observed = exp(logHypergeometric(a, r1, r2, c1) - logHypergeometric(mode, r1, r2, c1)) * (1 + 1e-7);
+
+  double total    = 1;
+  double included = observed >= 1 ? 1 : 0;
+  double p        = 1;
+
+  for(int x = mode; x < hi; x++){
+    p *= (double(r1 - x) * double(c1 - x)) / (double(x + 1) * double(r2 - c1 + x + 1));
+    total += p;
+    if(p <= observed){
+      included += p;
+      if(p < included * 1e-17){
+	break;
+      }
+    }
+  }
+
+  p = 1;
+
+  for(int x = mode; x > lo; x--){
+    p *= (double(x) * double(r2 - c1 + x)) / (double(r1 - x + 1) * double(c1 - x + 1));
+    total += p;
+    if(p <= observed){
+      included += p;
+      if(p < included * 1e-17){
+	break;
+      }
+    }
+  }
+
+  return min(1.0, included / total);
+}
+
+// each permutation draws the smaller cohort with a partial Fisher-Yates
+// shuffle of the genotypes; the other cohort is what is left of the
+// totals.  Shuffling what the last permutation left is as good as
+// starting over, so scratch is filled only once.
+
+double permuteLRT(const int * genotypeIndex,
+		  unsigned int n,
+		  unsigned int nt,
+		  double observed,
+		  int maxPermutations,
+		  uint64_t seed,
+		  vector<int> & scratch){
+
+  if(isnan(observed) || nt == 0 || nt >= n){
+    return 1;
+  }
+
+  scratch.assign(genotypeIndex, genotypeIndex + n);
+
+  int nCalled, nAlt;
+  countAlleles(genotypeIndex, n, &nCalled, &nAlt);
+
+  bool         drawTargets = nt <= n - nt;
+  unsigned int k           = drawTargets ? nt : n - nt;
+
+  permuteRng rng(seed);
+
+  double af[3];
+  int    hits = 0;
+  int    i    = 0;
+
+  while(i < maxPermutations){
+
+    i++;
+
+    int calledK = 0;
+    int altK    = 0;
+
+    for(unsigned int j = 0; j < k; j++){
+      unsigned int r = j + rng.below(n - j);
+      int g = scratch[r];
+      scratch[r] = scratch[j];
+      scratch[j] = g;
+      if(g >= 0){
+	calledK += 1;
+	altK    += g;
+      }
+    }
+
+    double lrt;
+
+    if(drawTargets){
+      lrt = allelicLRT(nCalled - calledK, nAlt - altK, calledK, altK, af);
+    }
+    else{
+      lrt = allelicLRT(calledK, altK, nCalled - calledK, nAlt - altK, af);
+    }
+
+    if(lrt >= observed){
+      hits += 1;
+      if(hits == PERMUTE_HITS){
+	return double(hits) / double(i);
+      }
+    }
+  }
+  return double(hits + 1) / double(maxPermutations + 1);
+}
@@ -0,0 +1,108 @@
+//
+//  assocTest.h
+//  wham
+//
+
+#ifndef assocTest_h
+#define assocTest_h
+
+#include <stdint.h>
+#include <vector>
+
+// log(k!) for integer k.  The table is filled once before any thread
+// scores, up to twice the number of samples (every allele count), and
+// only read afterwards; larger k fall back to lgamma.
+
+class logFactorials {
+
+ public:
+
+  std::vector<double> table;
+
+  void init(unsigned int);
+
+  double operator()(int k) const {
+    if(k >= 0 && (unsigned int) k < table.size()){
+      return table[k];
+    }
+    return slow(k);
+  }
+
+ private:
+
+  double slow(int) const;
+};
+
+extern logFactorials logFactorial;
+
+// called genotypes and alternative alleles over n genotype indices
+// (0/0, 0/1, 1/1 as 0, 1, 2; -1 for no call)
+
+void countAlleles(const int * genotypeIndex,
+		  unsigned int n,
+		  int * nCalled,
+		  int * nAlt);
+
+// log binomial probability of x successes in n trials
+
+double logBinomial(int x, int n, double p);
+
+// the allelic likelihood ratio test of two cohorts, from their called
+// genotypes and alternative alleles.  Allele frequencies of the first,
+// the second and both cohorts go to af[0], af[1] and af[2], each with
+// 1e-6 added so no frequency is 0.
+
+double allelicLRT(int nCalledA, int nAltA,
+		  int nCalledB, int nAltB,
+		  double * af);
+
+// two sided Fisher exact test of the 2x2 table a b / c d: the summed
+// probability of every table with the same margins that is no more
+// likely than the one given
+
+double fisherExact(int a, int b, int c, int d);
+
+// splitmix64: one small, independent stream per seed
+
+class permuteRng {
+
+ public:
+
+  uint64_t state;
+
+  permuteRng(uint64_t seed) : state(seed) {}
+
+  uint64_t next(void){
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  // uniform in [0, n)
+  unsigned int below(unsigned int n){
+    return (unsigned int)(((next() >> 32) * n) >> 32);
+  }
+};
+
+// number of permutations reaching the observed statistic after which
+// permuteLRT() stops
+
+#define PERMUTE_HITS 10
+
+// permutation p-value of allelicLRT() for the first nt of n samples
+// against the rest.  Sample labels are shuffled with the stream of seed
+// until PERMUTE_HITS permutations reach the observed statistic (p is
+// PERMUTE_HITS over the permutations run, as in Besag and Clifford
+// 1991) or maxPermutations are done (p is (hits + 1) / (max + 1)).
+// scratch is resized to n and overwritten.
+
+double permuteLRT(const int * genotypeIndex,
+		  unsigned int n,
+		  unsigned int nt,
+		  double observed,
+		  int maxPermutations,
+		  uint64_t seed,
+		  std::vector<int> & scratch);
+
+#endif
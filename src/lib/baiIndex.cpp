@@ -0,0 +1,299 @@
+//
+//  baiIndex.cpp
+//  wham
+//
+
+#include "baiIndex.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+baiCache indexCache;
+
+bool chunkLess(const baiChunk & a, const baiChunk & b){
+  return a.beg < b.beg;
+}
+
+bool binLess(const baiBin & a, const baiBin & b){
+  return a.bin < b.bin;
+}
+
+// the bins overlapping [beg, end) are, on each level of the SAM spec's
+// binning scheme, the numbers from first + (beg >> shift) to
+// first + ((end - 1) >> shift)
+
+static const uint32_t levelFirst[6] = {0, 1, 9, 73, 585, 4681};
+static const int      levelShift[6] = {29, 26, 23, 20, 17, 14};
+
+bool readBytes(vector<char> & buf, size_t * offset, void * dest, size_t n){
+  if(*offset + n > buf.size()){
+    return false;
+  }
+  memcpy(dest, &buf[*offset], n);
+  *offset += n;
+  return true;
+}
+
+bool baiIndex::load(const string & file){
+
+  path = file;
+  refs.clear();
+
+  FILE * fp = fopen(file.c_str(), "rb");
+  if(fp == NULL){
+    return false;
+  }
+
+  vector<char> buf;
+  char tmp[65536];
+  size_t n;
+  while((n = fread(tmp, 1, sizeof(tmp), fp)) > 0){
+    buf.insert(buf.end(), tmp, tmp + n);
+  }
+  fclose(fp);
+
+  size_t offset = 0;
+
+  char magic[4];
+  if(!readBytes(buf, &offset, magic, 4) || memcmp(magic, "BAI\1", 4) != 0){
+    return false;
+  }
+
+  int32_t nRef;
+  if(!readBytes(buf, &offset, &nRef, 4)){
+    return false;
+  }
+
+  refs.resize(nRef);
+
+  for(int32_t r = 0; r < nRef; r++){
+
+    baiReference & ref = refs[r];
+    ref.hasMeta   = false;
+    ref.refBeg    = 0;
+    ref.refEnd    = 0;
+    ref.nMapped   = 0;
+    ref.nUnmapped = 0;
+
+    int32_t nBin;
+    if(!readBytes(buf, &offset, &nBin, 4)){
+      return false;
+    }
+
+    ref.bins.reserve(nBin);
+
+    for(int32_t b = 0; b < nBin; b++){
+      uint32_t bin;
+      int32_t  nChunk;
+      if(!readBytes(buf, &offset, &bin, 4) || !readBytes(buf, &offset, &nChunk, 4)){
+	return false;
+      }
+
+      vector<baiChunk> chunks(nChunk);
+      for(int32_t c = 0; c < nChunk; c++){
+	if(!readBytes(buf, &offset, &chunks[c].beg, 8) || !readBytes(buf, &offset, &chunks[c].end, 8)){
+	  return false;
+	}
+      }
+
+      if(bin == BAI_META_BIN){
+	if(nChunk == 2){
+	  ref.hasMeta   = true;
+	  ref.refBeg    = chunks[0].beg;
+	  ref.refEnd    = chunks[0].end;
+	  ref.nMapped   = chunks[1].beg;
+	  ref.nUnmapped = chunks[1].end;
+	}
+	continue;
+      }
+
+      baiBin entry;
+      entry.bin        = bin;
+      entry.firstChunk = ref.chunks.size();
+      entry.nChunk     = nChunk;
+      ref.bins.push_back(entry);
+      ref.chunks.insert(ref.chunks.end(), chunks.begin(), chunks.end());
+    }
+
+    sort(ref.bins.begin(), ref.bins.end(), binLess);
+
+    int32_t nIntv;
+    if(!readBytes(buf, &offset, &nIntv, 4)){
+      return false;
+    }
+    ref.linear.resize(nIntv);
+    if(nIntv > 0 && !readBytes(buf, &offset, &ref.linear[0], 8 * nIntv)){
+      return false;
+    }
+  }
+  return true;
+}
+
+// chunks that may hold reads overlapping [beg, end) on reference ref,
+// sorted and merged
+
+bool baiIndex::query(int ref, long int beg, long int end, vector<baiChunk> & out) const {
+
+  out.clear();
+
+  if(ref < 0 || ref >= (int) refs.size()){
+    return false;
+  }
+  if(beg < 0){
+    beg = 0;
+  }
+
+  const baiReference & r = refs[ref];
+
+  uint64_t minOffset = 0;
+
+  if(!r.linear.empty()){
+    long int w = beg >> BAI_LINEAR_SHIFT;
+    if(w >= (long int) r.linear.size()){
+      w = r.linear.size() - 1;
+    }
+    while(w > 0 && r.linear[w] == 0){
+      w--;
+    }
+    minOffset = r.linear[w];
+  }
+
+  if(end > 1L << 29){
+    end = 1L << 29;
+  }
+
+  // the bins are sorted, so each level is one walk from lower_bound
+  for(int l = 0; l < 6 && beg < end; l++){
+
+    baiBin key;
+    key.bin         = levelFirst[l] + (beg >> levelShift[l]);
+    uint32_t maxBin = levelFirst[l] + ((end - 1) >> levelShift[l]);
+
+    vector<baiBin>::const_iterator it = lower_bound(r.bins.begin(), r.bins.end(), key, binLess);
+
+    for(; it != r.bins.end() && it->bin <= maxBin; it++){
+      for(uint32_t c = it->firstChunk; c < it->firstChunk + it->nChunk; c++){
+	if(r.chunks[c].end > minOffset){
+	  out.push_back(r.chunks[c]);
+	}
+      }
+    }
+  }
+
+  if(out.empty()){
+    return true;
+  }
+
+  sort(out.begin(), out.end(), chunkLess);
+
+  // merge chunks that overlap or that end and start in the same block
+
+  unsigned int last = 0;
+  for(unsigned int i = 1; i < out.size(); i++){
+    if(out[i].beg <= out[last].end || (out[last].end >> 16) == (out[i].beg >> 16)){
+      if(out[i].end > out[last].end){
+	out[last].end = out[i].end;
+      }
+    }
+    else{
+      last++;
+      out[last] = out[i];
+    }
+  }
+  out.resize(last + 1);
+
+  return true;
+}
+
+// compressed bytes holding the reads that overlap [beg, end) on
+// reference ref, from the chunks query() would read.  Each chunk counts
+// at least a byte, so 0 means there is nothing to read; the linear index
+// alone cannot tell, as indexers fill empty windows with the offset of
+// the window before.
+
+uint64_t baiIndex::span(int ref, long int beg, long int end) const {
+
+  vector<baiChunk> chunks;
+
+  if(end <= beg || !query(ref, beg, end, chunks)){
+    return 0;
+  }
+
+  uint64_t total = 0;
+
+  for(vector<baiChunk>::const_iterator c = chunks.begin(); c != chunks.end(); c++){
+    total += max((uint64_t) 1, ((*c).end >> 16) - ((*c).beg >> 16));
+  }
+  return total;
+}
+
+size_t baiIndex::bytes(void) const {
+  size_t total = sizeof(baiIndex);
+  for(vector<baiReference>::const_iterator r = refs.begin(); r != refs.end(); r++){
+    total += sizeof(baiReference);
+    total += r->bins.capacity()   * sizeof(baiBin);
+    total += r->chunks.capacity() * sizeof(baiChunk);
+    total += r->linear.capacity() * sizeof(uint64_t);
+  }
+  return total;
+}
+
+baiCache::baiCache(){
+  omp_init_lock(&cacheLock);
+}
+
+baiCache::~baiCache(){
+  for(map<string, baiIndex *>::iterator it = indices.begin(); it != indices.end(); it++){
+    delete it->second;
+  }
+  omp_destroy_lock(&cacheLock);
+}
+
+// looks for file.bam.bai then file.bai, like bamtools' LocateIndexes
+
+const baiIndex * baiCache::get(const string & bam){
+
+  omp_set_lock(&cacheLock);
+
+  map<string, baiIndex *>::iterator it = indices.find(bam);
+
+  if(it != indices.end()){
+    omp_unset_lock(&cacheLock);
+    return it->second;
+  }
+
+  baiIndex * idx = new baiIndex;
+
+  bool loaded = idx->load(bam + ".bai");
+
+  if(!loaded && bam.size() > 4 && bam.substr(bam.size() - 4) == ".bam"){
+    loaded = idx->load(bam.substr(0, bam.size() - 4) + ".bai");
+  }
+
+  if(!loaded){
+    delete idx;
+    idx = NULL;
+  }
+
+  indices[bam] = idx;
+
+  omp_unset_lock(&cacheLock);
+
+  return idx;
+}
+
+size_t baiCache::bytes(void){
+  size_t total = 0;
+  omp_set_lock(&cacheLock);
+  for(map<string, baiIndex *>::iterator it = indices.begin(); it != indices.end(); it++){
+    if(it->second != NULL){
+      total += it->second->bytes();
+    }
+  }
+  omp_unset_lock(&cacheLock);
+  return total;
+}
@@ -0,0 +1,77 @@
+//
+//  baiIndex.h
+//  wham
+//
+
+#ifndef baiIndex_h
+#define baiIndex_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <omp.h>
+
+#define BAI_LINEAR_SHIFT 14
+#define BAI_META_BIN     37450
+
+struct baiChunk{
+  uint64_t beg;
+  uint64_t end;
+};
+
+struct baiBin{
+  uint32_t bin       ;
+  uint32_t firstChunk;
+  uint32_t nChunk    ;
+};
+
+struct baiReference{
+  std::vector<baiBin>   bins   ; // sorted by bin number
+  std::vector<baiChunk> chunks ;
+  std::vector<uint64_t> linear ;
+
+  // from the pseudo bin, when the indexer wrote one
+  bool     hasMeta  ;
+  uint64_t refBeg   ;
+  uint64_t refEnd   ;
+  uint64_t nMapped  ;
+  uint64_t nUnmapped;
+};
+
+// a .bai parsed once into memory.  It is never modified after load()
+// so every thread can query it without locking.
+
+class baiIndex {
+
+ public:
+
+  std::string path;
+  std::vector<baiReference> refs;
+
+  bool load(const std::string &);
+  bool query(int, long int, long int, std::vector<baiChunk> &) const;
+  uint64_t span(int, long int, long int) const;
+  size_t bytes(void) const;
+};
+
+// process wide cache: one baiIndex per BAM, shared by every reader
+
+class baiCache {
+
+ public:
+
+  std::map<std::string, baiIndex *> indices;
+  omp_lock_t cacheLock;
+
+  baiCache();
+  ~baiCache();
+
+  const baiIndex * get(const std::string &);
+  size_t bytes(void);
+};
+
+extern baiCache indexCache;
+
+#endif
@@ -0,0 +1,433 @@
+//
+//  bamStream.cpp
+//  wham
+//
+
+#include "bamStream.h"
+
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+using namespace BamTools;
+
+static const char cigarTypes[] = "MIDNSHP=X";
+static const char baseCodes[]  = "=ACMGRSVTWYHKDBN";
+
+bamStream::bamStream(){
+  index      = NULL;
+  chunkIndex = 0;
+  regionRef  = -1;
+  regionBeg  = 0;
+  regionEnd  = 0;
+  done       = true;
+  recordRef  = -1;
+  recordPos  = -1;
+}
+
+bool bamStream::open(const string & file){
+
+  path  = file;
+  index = indexCache.get(file);
+
+  if(index == NULL){
+    return false;
+  }
+  if(!bgzf.open(file)){
+    return false;
+  }
+
+  char magic[4];
+  if(bgzf.read(magic, 4) != 4 || memcmp(magic, "BAM\1", 4) != 0){
+    return false;
+  }
+  return true;
+}
+
+void bamStream::close(void){
+  bgzf.close();
+  done = true;
+}
+
+// the right bound is inclusive and reads starting before the left bound
+// are kept if they reach it, as in BamReader::SetRegion
+
+bool bamStream::setRegion(int ref, long int beg, long int end){
+
+  regionRef  = ref;
+  regionBeg  = beg;
+  regionEnd  = end;
+  chunkIndex = 0;
+  done       = false;
+
+  index->query(ref, beg, end + 1, chunks);
+
+  if(chunks.empty()){
+    done = true;
+    return true;
+  }
+  bgzf.limit(chunks[0].end);
+
+  if(!bgzf.seek(chunks[0].beg)){
+    done = true;
+    return false;
+  }
+  return true;
+}
+
+bool bamStream::next(void){
+
+  while(!done){
+
+    if(bgzf.tell() >= chunks[chunkIndex].end){
+      chunkIndex++;
+      if(chunkIndex >= chunks.size()){
+	done = true;
+	break;
+      }
+      bgzf.limit(chunks[chunkIndex].end);
+      if(chunks[chunkIndex].beg > bgzf.tell() && !bgzf.seek(chunks[chunkIndex].beg)){
+	done = true;
+	break;
+      }
+      continue;
+    }
+
+    int32_t blockSize;
+
+    if(bgzf.read(&blockSize, 4) != 4 || blockSize < 32){
+      done = true;
+      break;
+    }
+
+    record.resize(blockSize);
+
+    if(bgzf.read(&record[0], blockSize) != blockSize){
+      done = true;
+      break;
+    }
+
+    memcpy(&recordRef, &record[0], 4);
+    memcpy(&recordPos, &record[4], 4);
+
+    if(recordRef != regionRef || recordPos > regionEnd){
+      done = true;
+      break;
+    }
+    if(endPosition() < regionBeg){
+      continue;
+    }
+    return true;
+  }
+  return false;
+}
+
+// same as BamAlignment::GetEndPosition(): one past the last aligned base
+
+long int bamStream::endPosition(void){
+
+  uint8_t  nameLength = record[8];
+  uint16_t nCigar;
+  memcpy(&nCigar, &record[12], 2);
+
+  long int end = recordPos;
+
+  const char * c = &record[32] + nameLength;
+
+  for(uint16_t i = 0; i < nCigar; i++){
+    uint32_t op;
+    memcpy(&op, c + 4 * i, 4);
+    switch(op & 0xF){
+    case 0:
+    case 2:
+    case 3:
+    case 7:
+    case 8:
+      {
+	end += op >> 4;
+	break;
+      }
+    default:
+      break;
+    }
+  }
+  return end;
+}
+
+bool bamStream::decodeCore(BamAlignment & al){
+
+  const char * d = &record[0];
+
+  uint8_t  nameLength;
+  uint16_t nCigar, flag, bin;
+  int32_t  seqLength;
+
+  al.RefID = recordRef;
+  al.Position = recordPos;
+  nameLength = d[8];
+  al.MapQuality = (uint8_t) d[9];
+  memcpy(&bin,             d + 10, 2);
+  memcpy(&nCigar,          d + 12, 2);
+  memcpy(&flag,            d + 14, 2);
+  memcpy(&seqLength,       d + 16, 4);
+  memcpy(&al.MateRefID,    d + 20, 4);
+  memcpy(&al.MatePosition, d + 24, 4);
+  memcpy(&al.InsertSize,   d + 28, 4);
+
+  al.Bin           = bin;
+  al.AlignmentFlag = flag;
+  al.Length        = seqLength;
+
+  if(32 + nameLength + 4 * nCigar > (int) record.size()){
+    return false;
+  }
+
+  // the CIGAR is part of the core so GetEndPosition() works, as in bamtools
+
+  const char * p = d + 32 + nameLength;
+
+  al.CigarData.clear();
+  al.CigarData.reserve(nCigar);
+  for(uint16_t i = 0; i < nCigar; i++){
+    uint32_t op;
+    memcpy(&op, p, 4);
+    al.CigarData.push_back(CigarOp(cigarTypes[op & 0xF], op >> 4));
+    p += 4;
+  }
+  return true;
+}
+
+// base qualities are never used by WHAM and are not decoded
+
+bool bamStream::decodeChars(BamAlignment & al){
+
+  const char * d   = &record[0];
+  const char * end = d + record.size();
+
+  uint8_t  nameLength = d[8];
+  uint16_t nCigar;
+  int32_t  seqLength;
+
+  memcpy(&nCigar,    d + 12, 2);
+  memcpy(&seqLength, d + 16, 4);
+
+  const char * p = d + 32;
+
+  if(p + nameLength + 4 * nCigar + (seqLength + 1) / 2 + seqLength > end){
+    return false;
+  }
+
+  al.Name.assign(p, nameLength > 0 ? nameLength - 1 : 0);
+  p += nameLength;
+  p += 4 * nCigar;
+
+  al.QueryBases.resize(seqLength);
+  for(int32_t i = 0; i < seqLength; i++){
+    uint8_t packed = p[i >> 1];
+    al.QueryBases[i] = baseCodes[(i & 1) ? (packed & 0xF) : (packed >> 4)];
+  }
+  p += (seqLength + 1) / 2;
+  p += seqLength;
+
+  al.Qualities.clear();
+  al.TagData.assign(p, end - p);
+
+  // Filename is left alone, bamMultiStream::sample() says where it came from
+
+  return true;
+}
+
+// bytes taken by one value of each tag type
+
+static int tagValueSize(char type){
+  switch(type){
+  case 'A':
+  case 'c':
+  case 'C':
+    return 1;
+  case 's':
+  case 'S':
+    return 2;
+  case 'i':
+  case 'I':
+  case 'f':
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+bool findStringTag(const string & tagData, const char * tag, strView & value){
+
+  const char * p   = tagData.data();
+  const char * end = p + tagData.size();
+
+  while(p + 3 <= end){
+
+    char type  = p[2];
+    bool match = p[0] == tag[0] && p[1] == tag[1];
+
+    p += 3;
+
+    if(type == 'Z' || type == 'H'){
+      const char * stop = (const char *) memchr(p, '\0', end - p);
+      if(stop == NULL){
+	return false;
+      }
+      if(match){
+	value = strView(p, stop);
+	return true;
+      }
+      p = stop + 1;
+      continue;
+    }
+
+    if(match){
+      return false;
+    }
+
+    if(type == 'B'){
+      if(p + 5 > end){
+	return false;
+      }
+      int32_t n;
+      memcpy(&n, p + 1, 4);
+      p += 5 + (long int) n * tagValueSize(p[0]);
+      continue;
+    }
+
+    int size = tagValueSize(type);
+    if(size == 0){
+      return false;
+    }
+    p += size;
+  }
+  return false;
+}
+
+bamMultiStream::bamMultiStream(){
+  pending = -1;
+  current = 0;
+  nCore   = 0;
+  nChars  = 0;
+}
+
+bamMultiStream::~bamMultiStream(){
+  close();
+}
+
+bool bamMultiStream::open(vector<string> & files){
+  close();
+  for(vector<string>::iterator f = files.begin(); f != files.end(); f++){
+    bamStream * s = new bamStream;
+    streams.push_back(s);
+    if(!s->open(*f)){
+      return false;
+    }
+  }
+  return true;
+}
+
+void bamMultiStream::close(void){
+  for(vector<bamStream *>::iterator s = streams.begin(); s != streams.end(); s++){
+    delete *s;
+  }
+  streams.clear();
+  heap.clear();
+  pending = -1;
+}
+
+// heap order: reference, position, then file order
+
+struct streamAfter{
+  vector<bamStream *> * s;
+  bool operator()(int a, int b) const {
+    bamStream * x = (*s)[a];
+    bamStream * y = (*s)[b];
+    if(x->recordRef != y->recordRef){
+      return x->recordRef > y->recordRef;
+    }
+    if(x->recordPos != y->recordPos){
+      return x->recordPos > y->recordPos;
+    }
+    return a > b;
+  }
+};
+
+bool bamMultiStream::setRegion(int ref, long int beg, long int end){
+
+  heap.clear();
+  pending = -1;
+
+  bool ok = true;
+
+  for(unsigned int i = 0; i < streams.size(); i++){
+    if(!streams[i]->setRegion(ref, beg, end)){
+      ok = false;
+      continue;
+    }
+    if(streams[i]->next()){
+      heap.push_back(i);
+    }
+  }
+
+  streamAfter order;
+  order.s = &streams;
+  make_heap(heap.begin(), heap.end(), order);
+
+  return ok;
+}
+
+// puts the stream of the last record back into the heap
+
+void bamMultiStream::advance(void){
+
+  if(pending < 0){
+    return;
+  }
+
+  streamAfter order;
+  order.s = &streams;
+
+  if(streams[pending]->next()){
+    push_heap(heap.begin(), heap.end(), order);
+  }
+  else{
+    heap.pop_back();
+  }
+  pending = -1;
+}
+
+bool bamMultiStream::getNextAlignmentCore(BamAlignment & al){
+
+  advance();
+
+  if(heap.empty()){
+    return false;
+  }
+
+  streamAfter order;
+  order.s = &streams;
+
+  pop_heap(heap.begin(), heap.end(), order);
+
+  pending = heap.back();
+  current = pending;
+  nCore  += 1;
+
+  return streams[pending]->decodeCore(al);
+}
+
+// without a pending record al already holds its character data
+
+bool bamMultiStream::buildCharData(BamAlignment & al){
+  if(pending < 0){
+    return true;
+  }
+  nChars += 1;
+  return streams[pending]->decodeChars(al);
+}
+
+bool bamMultiStream::getNextAlignment(BamAlignment & al){
+  return getNextAlignmentCore(al) && buildCharData(al);
+}
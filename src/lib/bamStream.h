@@ -0,0 +1,95 @@
+//
+//  bamStream.h
+//  wham
+//
+
+#ifndef bamStream_h
+#define bamStream_h
+
+#include  "api/BamAlignment.h"
+#include  "bgzf.h"
+#include  "baiIndex.h"
+#include  "split.h"
+
+#include <string>
+#include <vector>
+
+// region reader for a single sorted BAM.  bamtools keeps a private copy
+// of the index in every BamReader and offers no way to share one, so
+// region queries go through the process wide indexCache instead.
+
+class bamStream {
+
+ public:
+
+  std::string path;
+  bgzfStream  bgzf;
+
+  const baiIndex * index;
+
+  std::vector<baiChunk> chunks;
+  unsigned int chunkIndex;
+
+  int      regionRef;
+  long int regionBeg;
+  long int regionEnd;
+  bool     done;
+
+  // the current record, without its block_size
+  std::vector<char> record;
+  int32_t recordRef;
+  int32_t recordPos;
+
+  bamStream();
+
+  bool open(const std::string &);
+  void close(void);
+  bool setRegion(int, long int, long int);
+  bool next(void);
+  long int endPosition(void);
+  bool decodeCore(BamTools::BamAlignment &);
+  bool decodeChars(BamTools::BamAlignment &);
+};
+
+// finds a Z (or H) tag in BamAlignment::TagData without copying it, like
+// GetTag(tag, std::string &); value is left without the trailing NUL
+
+bool findStringTag(const std::string &, const char *, strView &);
+
+// merges the region of every sample by position, in the order of the
+// file list, like BamMultiReader.  As with bamtools,
+// getNextAlignmentCore() only fills the fixed fields and the CIGAR;
+// buildCharData() adds the name, bases and tags of that same record.
+
+class bamMultiStream {
+
+ public:
+
+  std::vector<bamStream *> streams;
+  std::vector<int> heap;
+
+  // stream of the record last returned, still at the back of heap
+  int pending;
+
+  // stream of the last record, kept once the region runs out
+  int current;
+
+  long int nCore ;
+  long int nChars;
+
+  bamMultiStream();
+  ~bamMultiStream();
+
+  bool open(std::vector<std::string> &);
+  void close(void);
+  bool setRegion(int, long int, long int);
+  void advance(void);
+  bool getNextAlignmentCore(BamTools::BamAlignment &);
+  bool buildCharData(BamTools::BamAlignment &);
+  bool getNextAlignment(BamTools::BamAlignment &);
+
+  // sample of the last record: its position in the file list
+  uint16_t sample(void){ return current; }
+};
+
+#endif
@@ -0,0 +1,144 @@
+//
+//  bcfWriter.cpp
+//  wham
+//
+
+#include "bcfWriter.h"
+
+#include <string.h>
+
+using namespace std;
+
+// the value of ID in a structured header line such as ##INFO=<ID=LRT,...>
+
+static bool headerId(const string & line, const char * prefix, string & id){
+
+  size_t n = strlen(prefix);
+
+  if(line.compare(0, n, prefix) != 0 || line.compare(n, 3, "ID=") != 0){
+    return false;
+  }
+
+  size_t end = line.find_first_of(",>", n + 3);
+
+  if(end == string::npos){
+    return false;
+  }
+  id = line.substr(n + 3, end - n - 3);
+  return true;
+}
+
+void bcfHeader::parse(const string & text){
+
+  strings.clear();
+  stringIds.clear();
+  contigs.clear();
+
+  strings.push_back("PASS");
+  stringIds["PASS"] = 0;
+
+  size_t start = 0;
+
+  while(start < text.size()){
+
+    size_t end = text.find('\n', start);
+    if(end == string::npos){
+      end = text.size();
+    }
+
+    string line = text.substr(start, end - start);
+    string id;
+
+    if(headerId(line, "##INFO=<",   id)
+       || headerId(line, "##FORMAT=<", id)
+       || headerId(line, "##FILTER=<", id)){
+      if(stringIds.find(id) == stringIds.end()){
+	stringIds[id] = strings.size();
+	strings.push_back(id);
+      }
+    }
+    else if(headerId(line, "##contig=<", id)){
+      contigs.push_back(id);
+    }
+    start = end + 1;
+  }
+}
+
+int bcfHeader::id(const string & key) const {
+  map<string, int>::const_iterator k = stringIds.find(key);
+  if(k == stringIds.end()){
+    return -1;
+  }
+  return k->second;
+}
+
+void bcfHeader::bytes(const string & text, string & out) const {
+  out.append("BCF\2\2", 5);
+  bcfPut(out, text.size() + 1, BCF_BT_INT32);
+  out.append(text);
+  out.push_back('\0');
+}
+
+void bcfPut(string & out, int32_t v, int type){
+  int n = type == BCF_BT_INT8 ? 1 : type == BCF_BT_INT16 ? 2 : 4;
+  uint32_t u = v;
+  for(int i = 0; i < n; i++){
+    out.push_back((char)((u >> (8 * i)) & 0xFF));
+  }
+}
+
+void bcfPutFloat(string & out, float v){
+  uint32_t u;
+  memcpy(&u, &v, 4);
+  bcfPut(out, u, BCF_BT_INT32);
+}
+
+// overwrites four bytes at offset, for lengths known only afterwards
+
+void bcfPutLength(string & out, size_t offset, uint32_t v){
+  for(int i = 0; i < 4; i++){
+    out[offset + i] = (char)((v >> (8 * i)) & 0xFF);
+  }
+}
+
+// the smallest integer type holding min to max; the lowest few values
+// of each type are reserved for missing and end of vector
+
+int bcfIntType(int32_t min, int32_t max){
+  if(min > -120 && max <= 127){
+    return BCF_BT_INT8;
+  }
+  if(min > -32760 && max <= 32767){
+    return BCF_BT_INT16;
+  }
+  return BCF_BT_INT32;
+}
+
+// counts of 15 and more follow the descriptor as a typed integer
+
+void bcfTypeDescriptor(string & out, int n, int type){
+  if(n < 15){
+    out.push_back((char)((n << 4) | type));
+    return;
+  }
+  out.push_back((char)((15 << 4) | type));
+  bcfInt(out, n);
+}
+
+void bcfInt(string & out, int32_t v){
+  int type = bcfIntType(v, v);
+  bcfTypeDescriptor(out, 1, type);
+  bcfPut(out, v, type);
+}
+
+void bcfFloats(string & out, const float * v, int n){
+  bcfTypeDescriptor(out, n, BCF_BT_FLOAT);
+  for(int i = 0; i < n; i++){
+    bcfPutFloat(out, v[i]);
+  }
+}
+
+void bcfString(string & out, const char * s, size_t n){
+  bcfTypeDescriptor(out, n, BCF_BT_CHAR);
+  out.append(s, n);
+}
@@ -0,0 +1,56 @@
+//
+//  bcfWriter.h
+//  wham
+//
+
+#ifndef bcfWriter_h
+#define bcfWriter_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+// BCF 2.2 typed values
+
+#define BCF_BT_NULL  0
+#define BCF_BT_INT8  1
+#define BCF_BT_INT16 2
+#define BCF_BT_INT32 3
+#define BCF_BT_FLOAT 5
+#define BCF_BT_CHAR  7
+
+#define BCF_FLOAT_MISSING 0x7F800001
+
+// the dictionaries of a VCF header: INFO, FORMAT and FILTER ids in the
+// order they are first defined (PASS always first) and the contigs
+
+class bcfHeader {
+
+ public:
+
+  std::vector<std::string>    strings;
+  std::map<std::string, int>  stringIds;
+  std::vector<std::string>    contigs;
+
+  void parse(const std::string &);
+  int  id(const std::string &) const;
+
+  // the magic, the length and the NUL terminated text
+  void bytes(const std::string &, std::string &) const;
+};
+
+// appending BCF values to a record.  The put functions write bare
+// little endian values, the others a type descriptor and then values.
+
+void bcfPut(std::string &, int32_t, int);
+void bcfPutFloat(std::string &, float);
+void bcfPutLength(std::string &, size_t, uint32_t);
+
+int  bcfIntType(int32_t, int32_t);
+void bcfTypeDescriptor(std::string &, int, int);
+void bcfInt(std::string &, int32_t);
+void bcfFloats(std::string &, const float *, int);
+void bcfString(std::string &, const char *, size_t);
+
+#endif
@@ -0,0 +1,506 @@
+//
+//  bgzf.cpp
+//  wham
+//
+
+#include "bgzf.h"
+
+#include <string.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+struct inflateQueue{
+  vector<std::thread>     helpers;
+  deque<bgzfBlock *>      queue;
+  std::mutex              queueMutex;
+  std::condition_variable queueReady;
+  bool                    stopping;
+};
+
+inflatePool inflaters;
+
+inflatePool::inflatePool(){
+  q = new inflateQueue;
+  q->stopping = false;
+}
+
+inflatePool::~inflatePool(){
+  stop();
+  delete q;
+}
+
+void inflatePool::start(int n){
+  stop();
+  q->stopping = false;
+  for(int i = 0; i < n; i++){
+    q->helpers.push_back(std::thread(&inflatePool::work, this));
+  }
+}
+
+void inflatePool::stop(void){
+  {
+    std::lock_guard<std::mutex> guard(q->queueMutex);
+    q->stopping = true;
+  }
+  q->queueReady.notify_all();
+
+  for(vector<std::thread>::iterator h = q->helpers.begin(); h != q->helpers.end(); h++){
+    (*h).join();
+  }
+  q->helpers.clear();
+
+  // anything left over is still BGZF_QUEUED and gets inflated by its reader
+  std::lock_guard<std::mutex> guard(q->queueMutex);
+  for(deque<bgzfBlock *>::iterator b = q->queue.begin(); b != q->queue.end(); b++){
+    (*b)->inQueue = false;
+  }
+  q->queue.clear();
+}
+
+int inflatePool::size(void){
+  return q->helpers.size();
+}
+
+void inflatePool::submit(bgzfBlock * b){
+  b->state = BGZF_QUEUED;
+  if(q->helpers.empty()){
+    return;
+  }
+  b->inQueue = true;
+  {
+    std::lock_guard<std::mutex> guard(q->queueMutex);
+    q->queue.push_back(b);
+  }
+  q->queueReady.notify_one();
+}
+
+void inflatePool::work(void){
+
+  z_stream hzs;
+  memset(&hzs, 0, sizeof(hzs));
+  inflateInit2(&hzs, -15);
+
+  while(true){
+
+    bgzfBlock * b;
+
+    {
+      std::unique_lock<std::mutex> guard(q->queueMutex);
+      while(!q->stopping && q->queue.empty()){
+	q->queueReady.wait(guard);
+      }
+      if(q->stopping){
+	break;
+      }
+      b = q->queue.front();
+      q->queue.pop_front();
+    }
+
+    int expected = BGZF_QUEUED;
+    if(b->state.compare_exchange_strong(expected, BGZF_RUNNING)){
+      inflateBlock(b, &hzs);
+      b->state = BGZF_DONE;
+    }
+    // the last touch: after this the reader may reuse or free the block
+    b->inQueue = false;
+  }
+
+  inflateEnd(&hzs);
+}
+
+// the raw deflate payload of a block, without the gzip header or footer
+
+bool inflatePool::inflateBlock(bgzfBlock * b, z_stream * zs){
+
+  inflateReset(zs);
+
+  zs->next_in   = (Bytef *) &b->compressed[0];
+  zs->avail_in  = b->compressedLength - BGZF_FOOTER_SIZE;
+  zs->next_out  = (Bytef *) &b->data[0];
+  zs->avail_out = BGZF_MAX_BLOCK;
+
+  b->ok = (inflate(zs, Z_FINISH) == Z_STREAM_END);
+
+  b->length = BGZF_MAX_BLOCK - zs->avail_out;
+
+  return b->ok;
+}
+
+bgzfStream::bgzfStream(){
+  fp           = NULL;
+  current      = 0;
+  nAhead       = 0;
+  blockAddress = -1;
+  nextAddress  = 0;
+  blockLength  = 0;
+  blockOffset  = 0;
+  fetchAddress = 0;
+  limitAddress = -1;
+  filePosition = -1;
+
+  for(int i = 0; i < BGZF_READ_AHEAD + 1; i++){
+    bgzfBlock * b   = new bgzfBlock;
+    b->compressedLength = 0;
+    b->length       = 0;
+    b->address      = -1;
+    b->nextAddress  = -1;
+    b->ok           = false;
+    b->state        = BGZF_DONE;
+    b->inQueue      = false;
+    ring.push_back(b);
+  }
+}
+
+bgzfStream::~bgzfStream(){
+  close();
+  for(vector<bgzfBlock *>::iterator b = ring.begin(); b != ring.end(); b++){
+    while((*b)->inQueue){
+      std::this_thread::yield();
+    }
+    delete *b;
+  }
+}
+
+bool bgzfStream::open(const string & file){
+  close();
+  path = file;
+  fp   = fopen(file.c_str(), "rb");
+  if(fp == NULL){
+    return false;
+  }
+  blockAddress = -1;
+  nextAddress  = 0;
+  blockLength  = 0;
+  blockOffset  = 0;
+  fetchAddress = 0;
+  limitAddress = -1;
+  filePosition = 0;
+  return true;
+}
+
+void bgzfStream::close(void){
+  drain();
+  if(fp != NULL){
+    fclose(fp);
+    fp = NULL;
+  }
+}
+
+// reads one compressed block; inflating it is left to finish()
+
+bool bgzfStream::fetch(bgzfBlock * b, int64_t address){
+
+  while(b->inQueue){
+    std::this_thread::yield();
+  }
+
+  b->address = -1;
+  b->ok      = false;
+
+  unsigned char header[BGZF_HEADER_SIZE];
+
+  if(filePosition != address){
+    if(fseeko(fp, address, SEEK_SET) != 0){
+      filePosition = -1;
+      return false;
+    }
+    filePosition = address;
+  }
+
+  if(fread(header, 1, BGZF_HEADER_SIZE, fp) != BGZF_HEADER_SIZE){
+    filePosition = -1;
+    return false;
+  }
+
+  if(header[0] != 31 || header[1] != 139 || header[12] != 'B' || header[13] != 'C'){
+    filePosition = -1;
+    return false;
+  }
+
+  int blockSize = (header[16] | (header[17] << 8)) + 1;
+
+  if(blockSize <= BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE || blockSize > BGZF_MAX_BLOCK){
+    filePosition = -1;
+    return false;
+  }
+
+  int remaining = blockSize - BGZF_HEADER_SIZE;
+
+  if(b->compressed.size() < (size_t) remaining){
+    b->compressed.resize(BGZF_MAX_BLOCK);
+  }
+  if(b->data.size() < BGZF_MAX_BLOCK){
+    b->data.resize(BGZF_MAX_BLOCK);
+  }
+
+  if(fread(&b->compressed[0], 1, remaining, fp) != (size_t) remaining){
+    filePosition = -1;
+    return false;
+  }
+
+  filePosition        = address + blockSize;
+  b->compressedLength = remaining;
+  b->address          = address;
+  b->nextAddress      = address + blockSize;
+  b->state            = BGZF_QUEUED;
+
+  return true;
+}
+
+// the z_stream of the reading thread
+
+struct readerInflater{
+  z_stream zs;
+  readerInflater(){
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, -15);
+  }
+  ~readerInflater(){
+    inflateEnd(&zs);
+  }
+};
+
+static thread_local readerInflater readerZs;
+
+// inflates the block here unless a helper already has it
+
+bool bgzfStream::finish(bgzfBlock * b){
+  int expected = BGZF_QUEUED;
+  if(b->state.compare_exchange_strong(expected, BGZF_RUNNING)){
+    inflatePool::inflateBlock(b, &readerZs.zs);
+    b->state = BGZF_DONE;
+  }
+  else{
+    while(b->state != BGZF_DONE){
+      std::this_thread::yield();
+    }
+  }
+  return b->ok;
+}
+
+void bgzfStream::cancel(bgzfBlock * b){
+  int expected = BGZF_QUEUED;
+  if(!b->state.compare_exchange_strong(expected, BGZF_DONE)){
+    while(b->state != BGZF_DONE){
+      std::this_thread::yield();
+    }
+  }
+  b->address = -1;
+  b->ok      = false;
+}
+
+void bgzfStream::drain(void){
+  for(unsigned int i = 1; i <= nAhead; i++){
+    cancel(ring[(current + i) % ring.size()]);
+  }
+  nAhead = 0;
+}
+
+void bgzfStream::fillAhead(void){
+  while(nAhead < BGZF_READ_AHEAD && fetchAddress <= limitAddress && inflaters.size() > 0){
+    bgzfBlock * b = ring[(current + 1 + nAhead) % ring.size()];
+    if(!fetch(b, fetchAddress)){
+      break;
+    }
+    fetchAddress = b->nextAddress;
+    nAhead++;
+    inflaters.submit(b);
+  }
+}
+
+bool bgzfStream::readBlock(void){
+
+  bgzfBlock * b = NULL;
+
+  // the next block is usually already in flight
+
+  if(nAhead > 0){
+    unsigned int n = (current + 1) % ring.size();
+    if(ring[n]->address == nextAddress){
+      current = n;
+      nAhead--;
+      b = ring[n];
+    }
+    else{
+      drain();
+    }
+  }
+
+  // nothing is in flight, so the slot just read is reused
+
+  if(b == NULL){
+    b = ring[current];
+    if(!fetch(b, nextAddress)){
+      blockAddress = -1;
+      blockLength  = 0;
+      blockOffset  = 0;
+      return false;
+    }
+    fetchAddress = b->nextAddress;
+  }
+
+  fillAhead();
+
+  if(!finish(b)){
+    blockAddress = -1;
+    blockLength  = 0;
+    blockOffset  = 0;
+    return false;
+  }
+
+  blockAddress = b->address;
+  nextAddress  = b->nextAddress;
+  blockLength  = b->length;
+  blockOffset  = 0;
+
+  return true;
+}
+
+bool bgzfStream::seek(uint64_t voffset){
+
+  int64_t address = voffset >> 16;
+
+  if(address != blockAddress){
+
+    // drop in-flight blocks that come before the target
+
+    while(nAhead > 0 && ring[(current + 1) % ring.size()]->address != address){
+      current = (current + 1) % ring.size();
+      cancel(ring[current]);
+      nAhead--;
+    }
+
+    nextAddress = address;
+
+    if(!readBlock()){
+      return false;
+    }
+  }
+
+  blockOffset = voffset & 0xFFFF;
+
+  return true;
+}
+
+// blocks past the one holding voffset are not read ahead
+
+void bgzfStream::limit(uint64_t voffset){
+  limitAddress = voffset >> 16;
+}
+
+// offsets at the very end of a block are reported as the start of the
+// next block, the same address the index uses
+
+uint64_t bgzfStream::tell(void){
+  if(blockOffset >= blockLength){
+    return nextAddress << 16;
+  }
+  return (blockAddress << 16) | blockOffset;
+}
+
+int bgzfStream::read(void * buf, int n){
+
+  char * out = (char *) buf;
+  int    got = 0;
+
+  while(got < n){
+    if(blockOffset >= blockLength){
+      if(!readBlock()){
+	break;
+      }
+      // the EOF marker is an empty block
+      if(blockLength == 0){
+	break;
+      }
+    }
+    int take = blockLength - blockOffset;
+    if(take > n - got){
+      take = n - got;
+    }
+    memcpy(out + got, &ring[current]->data[blockOffset], take);
+    blockOffset += take;
+    got         += take;
+  }
+  return got;
+}
+
+bgzfDeflater::bgzfDeflater(){
+  memset(&zs, 0, sizeof(zs));
+  deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+}
+
+bgzfDeflater::~bgzfDeflater(){
+  deflateEnd(&zs);
+}
+
+static void putLittle(string & out, uint32_t v, int n){
+  for(int i = 0; i < n; i++){
+    out.push_back((char)((v >> (8 * i)) & 0xFF));
+  }
+}
+
+// one block at the given level; false if it does not fit BGZF_MAX_BLOCK
+
+bool bgzfDeflater::deflateBlock(const char * text, int n, string & out, int level){
+
+  size_t start = out.size();
+
+  static const unsigned char header[BGZF_HEADER_SIZE] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0
+  };
+
+  out.append((const char *) header, BGZF_HEADER_SIZE);
+  out.resize(start + BGZF_MAX_BLOCK);
+
+  deflateReset(&zs);
+  deflateParams(&zs, level, Z_DEFAULT_STRATEGY);
+
+  zs.next_in   = (Bytef *) text;
+  zs.avail_in  = n;
+  zs.next_out  = (Bytef *) &out[start + BGZF_HEADER_SIZE];
+  zs.avail_out = BGZF_MAX_BLOCK - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+
+  if(deflate(&zs, Z_FINISH) != Z_STREAM_END){
+    out.resize(start);
+    return false;
+  }
+
+  size_t compressed = BGZF_MAX_BLOCK - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE - zs.avail_out;
+  size_t blockSize  = BGZF_HEADER_SIZE + compressed + BGZF_FOOTER_SIZE;
+
+  out.resize(start + BGZF_HEADER_SIZE + compressed);
+  out[start + 16] = (char)((blockSize - 1) & 0xFF);
+  out[start + 17] = (char)((blockSize - 1) >> 8);
+
+  putLittle(out, crc32(crc32(0L, Z_NULL, 0), (const Bytef *) text, n), 4);
+  putLittle(out, n, 4);
+
+  return true;
+}
+
+void bgzfDeflater::compress(const char * text, size_t n, string & out, vector<uint32_t> & blockStarts){
+
+  for(size_t done = 0; done < n; done += BGZF_BLOCK_TEXT){
+
+    int take = n - done < BGZF_BLOCK_TEXT ? n - done : BGZF_BLOCK_TEXT;
+
+    blockStarts.push_back(out.size());
+
+    if(!deflateBlock(text + done, take, out, Z_DEFAULT_COMPRESSION)){
+      deflateBlock(text + done, take, out, Z_NO_COMPRESSION);
+    }
+  }
+  blockStarts.push_back(out.size());
+}
+
+void bgzfDeflater::eof(string & out){
+  static const unsigned char empty[28] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0,
+    3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+  };
+  out.append((const char *) empty, 28);
+}
@@ -0,0 +1,143 @@
+//
+//  bgzf.h
+//  wham
+//
+
+#ifndef bgzf_h
+#define bgzf_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <zlib.h>
+
+// BGZF_MAX_BLOCK is the largest (un)compressed block a BGZF file may hold
+
+#define BGZF_MAX_BLOCK   65536
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+
+// number of blocks inflated ahead of the block being read
+
+#define BGZF_READ_AHEAD  2
+
+// block states
+#define BGZF_QUEUED   0
+#define BGZF_RUNNING  1
+#define BGZF_DONE     2
+
+struct bgzfBlock{
+  std::vector<char> compressed;
+  std::vector<char> data;
+  int     compressedLength;
+  int     length ;
+  int64_t address;
+  int64_t nextAddress;
+  bool    ok     ;
+
+  std::atomic<int>  state  ;
+  std::atomic<bool> inQueue;
+};
+
+// helper threads that inflate queued blocks.  Whoever gets to a queued
+// block first inflates it, so the reading thread never waits on a
+// block nobody has started.  The threads and the queue live in
+// bgzf.cpp to keep <thread> and <mutex> out of the headers.
+
+struct inflateQueue;
+
+class inflatePool {
+
+ public:
+
+  inflateQueue * q;
+
+  inflatePool();
+  ~inflatePool();
+
+  void start(int);
+  void stop(void);
+  int  size(void);
+  void submit(bgzfBlock *);
+  void work(void);
+
+  static bool inflateBlock(bgzfBlock *, z_stream *);
+};
+
+extern inflatePool inflaters;
+
+// text taken per block when writing; what bgzip and htslib use, so
+// even incompressible text fits a block when stored
+
+#define BGZF_BLOCK_TEXT  65280
+
+// compresses text into BGZF blocks, one z_stream per thread.  Every
+// block holds BGZF_BLOCK_TEXT bytes of text except the last.
+
+class bgzfDeflater {
+
+ public:
+
+  z_stream zs;
+
+  bgzfDeflater();
+  ~bgzfDeflater();
+
+  // appends the blocks to out and where each starts within out, plus
+  // one past the end
+  void compress(const char *, size_t, std::string &, std::vector<uint32_t> &);
+  bool deflateBlock(const char *, int, std::string &, int);
+
+  // the empty block that marks the end of a BGZF file
+  static void eof(std::string &);
+};
+
+// a minimal BGZF reader: random access by virtual offset
+// (compressed block address << 16 | offset within the block).  Only
+// the block being read has buffers unless helper threads are running,
+// when the read ahead slots get theirs as they are first filled.  The
+// reading thread inflates with one z_stream shared by all its streams.
+
+class bgzfStream {
+
+ public:
+
+  FILE * fp;
+  std::string path;
+
+  // ring[current] is being read, the next nAhead slots are in flight
+  std::vector<bgzfBlock *> ring;
+  unsigned int current;
+  unsigned int nAhead ;
+
+  int64_t blockAddress;
+  int64_t nextAddress ;
+  int     blockLength ;
+  int     blockOffset ;
+
+  // next block to fetch ahead, and the last block worth fetching
+  int64_t fetchAddress;
+  int64_t limitAddress;
+  int64_t filePosition;
+
+  bgzfStream();
+  ~bgzfStream();
+
+  bool open(const std::string &);
+  void close(void);
+  bool seek(uint64_t);
+  void limit(uint64_t);
+  uint64_t tell(void);
+  int  read(void *, int);
+
+  bool readBlock(void);
+  bool fetch(bgzfBlock *, int64_t);
+  bool finish(bgzfBlock *);
+  void cancel(bgzfBlock *);
+  void drain(void);
+  void fillAhead(void);
+};
+
+#endif
@@ -0,0 +1,172 @@
+//
+//  clipConsensus.cpp
+//  wham
+//
+
+#include "clipConsensus.h"
+
+#include <algorithm>
+
+using namespace std;
+
+#define CLIP_CONSENSUS_MAX 20
+
+string clipConsensus(vector<string> & clips, bool anchoredAtEnd, double * nn){
+
+  if(clips.empty()){
+    return ".";
+  }
+
+  if(clips.size() == 1){
+    return clips[0];
+  }
+
+  unsigned int nClips = min((size_t) CLIP_CONSENSUS_MAX, clips.size());
+  unsigned int first  = clips.size() - nClips;
+  size_t       width  = 0;
+
+  for(unsigned int c = first; c < clips.size(); c++){
+    width = max(width, clips[c].size());
+  }
+
+  string con(width, 'N');
+
+  // k counts bases away from the breakpoint
+
+  for(size_t k = 0; k < width; k++){
+
+    char base = 0;
+    bool same = true;
+
+    for(unsigned int c = first; c < clips.size(); c++){
+      const string & s = clips[c];
+      if(k >= s.size()){
+	continue;
+      }
+      char b = anchoredAtEnd ? s[s.size() - 1 - k] : s[k];
+      if(base == 0){
+	base = b;
+      }
+      else if(b != base){
+	same = false;
+	break;
+      }
+    }
+
+    size_t column = anchoredAtEnd ? width - 1 - k : k;
+
+    if(same){
+      con[column] = base;
+    }
+    else{
+      *nn += 1;
+    }
+  }
+
+  return con;
+}
+
+consensusCache::consensusCache(){
+  entries.resize(CONSENSUS_CACHE_SIZE);
+  for(vector<consensusEntry>::iterator e = entries.begin(); e != entries.end(); e++){
+    (*e).key           = 0;
+    (*e).used          = false;
+    (*e).anchoredAtEnd = false;
+    (*e).ordered       = false;
+    (*e).nn            = 0;
+  }
+  nHits   = 0;
+  nMisses = 0;
+}
+
+void consensusClips(vector<string> & clips, bool ordered, vector<string> & out){
+
+  unsigned int nClips = min((size_t) CLIP_CONSENSUS_MAX, clips.size());
+
+  out.assign(clips.end() - nClips, clips.end());
+
+  if(! ordered){
+    sort(out.begin(), out.end());
+  }
+}
+
+bool consensusCache::find(uint64_t key,
+			  vector<string> & clips,
+			  bool anchoredAtEnd,
+			  bool ordered,
+			  string & seq,
+			  double * nn){
+
+  consensusEntry & e = entries[key & (CONSENSUS_CACHE_SIZE - 1)];
+
+  if(! e.used || e.key != key || e.anchoredAtEnd != anchoredAtEnd || e.ordered != ordered){
+    nMisses += 1;
+    return false;
+  }
+
+  consensusClips(clips, ordered, scratch);
+
+  if(scratch != e.clips){
+    nMisses += 1;
+    return false;
+  }
+
+  nHits += 1;
+  seq  = e.seq;
+  *nn += e.nn;
+  return true;
+}
+
+void consensusCache::store(uint64_t key,
+			   vector<string> & clips,
+			   bool anchoredAtEnd,
+			   bool ordered,
+			   const string & seq,
+			   double nn){
+
+  consensusEntry & e = entries[key & (CONSENSUS_CACHE_SIZE - 1)];
+
+  e.key           = key;
+  e.used          = true;
+  e.anchoredAtEnd = anchoredAtEnd;
+  e.ordered       = ordered;
+  e.seq           = seq;
+  e.nn            = nn;
+
+  consensusClips(clips, ordered, e.clips);
+}
+
+// FNV-1a, continued from h
+
+static uint64_t fnv(uint64_t h, const char * p, size_t n){
+  for(size_t i = 0; i < n; i++){
+    h ^= (unsigned char) p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t consensusKey(vector<string> & clips, bool anchoredAtEnd, bool ordered){
+
+  unsigned int nClips = min((size_t) CLIP_CONSENSUS_MAX, clips.size());
+
+  vector<uint64_t> hashes;
+  hashes.reserve(nClips);
+
+  for(unsigned int c = clips.size() - nClips; c < clips.size(); c++){
+    hashes.push_back(fnv(14695981039346656037ULL, clips[c].data(), clips[c].size()));
+  }
+  if(! ordered){
+    sort(hashes.begin(), hashes.end());
+  }
+
+  uint64_t h = 14695981039346656037ULL;
+
+  for(vector<uint64_t>::iterator it = hashes.begin(); it != hashes.end(); it++){
+    h = fnv(h, (const char *) &(*it), sizeof(uint64_t));
+  }
+
+  char flags[2] = { anchoredAtEnd, ordered };
+
+  return fnv(h, flags, 2);
+}
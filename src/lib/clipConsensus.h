@@ -0,0 +1,73 @@
+//
+//  clipConsensus.h
+//  wham
+//
+
+#ifndef clipConsensus_h
+#define clipConsensus_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// consensus of the soft clipped tails at one breakpoint.  The tails all
+// start at the breakpoint (back clips) or end there (front clips, pass
+// anchoredAtEnd), so they are lined up on that side without gaps and
+// voted on column by column.  As with the seqan path, only the last 20
+// tails are used, a column with a single base seen gives that base and
+// any other column gives an N and adds one to nn.
+
+std::string clipConsensus(std::vector<std::string> & clips,
+			  bool anchoredAtEnd,
+			  double * nn);
+
+// neighbouring candidates often pass the same clips, so each thread
+// keeps the last consensus for every slot of a small direct mapped table.
+// An entry keeps the clips it was built from and a hit is only taken
+// when they are the same, so two clip sets with one key cost a rebuild
+// rather than a wrong ALT.
+
+#define CONSENSUS_CACHE_SIZE 256
+
+struct consensusEntry {
+  uint64_t    key ;
+  bool        used;
+  bool        anchoredAtEnd;
+  bool        ordered      ;
+  std::vector<std::string> clips; // as consensusClips() gives them
+  std::string seq ;
+  double      nn  ;
+};
+
+class consensusCache {
+
+ public:
+
+  std::vector<consensusEntry> entries;
+  std::vector<std::string>    scratch;
+
+  long int nHits  ;
+  long int nMisses;
+
+  consensusCache();
+
+  bool find(uint64_t, std::vector<std::string> &, bool, bool, std::string &, double *);
+  void store(uint64_t, std::vector<std::string> &, bool, bool, const std::string &, double);
+};
+
+// the clips a consensus is built from (the last 20), sorted when their
+// order does not matter
+
+void consensusClips(std::vector<std::string> & clips,
+		    bool ordered,
+		    std::vector<std::string> & out);
+
+// hash of the clips a consensus is built from (the last 20) and how they
+// are lined up.  With ordered false the clips count as a set, which is
+// all clipConsensus() looks at.
+
+uint64_t consensusKey(std::vector<std::string> & clips,
+		      bool anchoredAtEnd,
+		      bool ordered);
+
+#endif
@@ -7,11 +7,146 @@
 //
 
 #include "readPileUp.h"
+#include "bamStream.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace BamTools;
 
-bool sameStrand(BamAlignment & al){
+// FNV-1a.  Names from one run share long prefixes, which makes
+// comparing them as strings slow.
+
+uint64_t hashName(const string & name){
+  uint64_t h = 14695981039346656037ULL;
+  for(string::const_iterator c = name.begin(); c != name.end(); c++){
+    h ^= (unsigned char) *c;
+    h *= 1099511628211ULL;
+  }
+  if(h == 0){
+    h = 1;
+  }
+  return h;
+}
+
+nameCounts::nameCounts(){
+  keys.resize(1024, 0);
+  counts.resize(1024, 0);
+  used = 0;
+}
+
+unsigned int nameCounts::slot(uint64_t key){
+  unsigned int mask = keys.size() - 1;
+  unsigned int i    = (key ^ (key >> 32)) & mask;
+  while(keys[i] != 0 && keys[i] != key){
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+void nameCounts::grow(void){
+
+  vector<uint64_t> oldKeys;
+  vector<int>      oldCounts;
+
+  oldKeys.swap(keys);
+  oldCounts.swap(counts);
+
+  keys.resize(oldKeys.size() * 2, 0);
+  counts.resize(oldKeys.size() * 2, 0);
+
+  for(unsigned int i = 0; i < oldKeys.size(); i++){
+    if(oldKeys[i] != 0){
+      unsigned int s = slot(oldKeys[i]);
+      keys[s]   = oldKeys[i];
+      counts[s] = oldCounts[i];
+    }
+  }
+}
+
+// a name whose count drops to zero is removed by shifting the rest of
+// its probe run back, so no tombstones are left behind
+
+void nameCounts::add(uint64_t key, int n){
+
+  if((used + 1) * 2 > keys.size()){
+    grow();
+  }
+
+  unsigned int i = slot(key);
+
+  if(keys[i] == 0){
+    keys[i]   = key;
+    counts[i] = 0;
+    used     += 1;
+  }
+
+  counts[i] += n;
+
+  if(counts[i] != 0){
+    return;
+  }
+
+  unsigned int mask = keys.size() - 1;
+  unsigned int hole = i;
+  unsigned int j    = i;
+
+  while(true){
+    j = (j + 1) & mask;
+    if(keys[j] == 0){
+      break;
+    }
+    unsigned int home = (keys[j] ^ (keys[j] >> 32)) & mask;
+    // keys[j] can fill the hole if its home is not between hole and j
+    if(((j - home) & mask) >= ((j - hole) & mask)){
+      keys[hole]   = keys[j];
+      counts[hole] = counts[j];
+      hole = j;
+    }
+  }
+  keys[hole]   = 0;
+  counts[hole] = 0;
+  used        -= 1;
+}
+
+bool nameCounts::has(uint64_t key){
+  return keys[slot(key)] != 0;
+}
+
+int nameCounts::count(uint64_t key){
+  return counts[slot(key)];
+}
+
+void nameCounts::clear(void){
+  if(used == 0){
+    return;
+  }
+  fill(keys.begin(), keys.end(), 0);
+  fill(counts.begin(), counts.end(), 0);
+  used = 0;
+}
+
+bool nameCounts::operator==(nameCounts & o){
+  if(used != o.used){
+    return false;
+  }
+  for(unsigned int i = 0; i < keys.size(); i++){
+    if(keys[i] != 0 && o.count(keys[i]) != counts[i]){
+      return false;
+    }
+  }
+  return true;
+}
+
+bool sameStrand(pileupRead & al){
 
   if(( al.IsReverseStrand() && al.IsMateReverseStrand() ) 
      || ( ! al.IsReverseStrand() && ! al.IsMateReverseStrand() )){
@@ -20,51 +155,50 @@ bool sameStrand(BamAlignment & al){
   return false;
 }
 
-bool readPileUp::processDiscordant(BamAlignment & al, string & saTag){
+bool readPileUp::processDiscordant(pileupRead & al, int sign){
 
-  nDiscordant++;
+  nDiscordant += sign;
 
   if(sameStrand(al)){
-    nsameStrandDiscordant++;
+    nsameStrandDiscordant += sign;
   }
 
   if((al.RefID =! al.MateRefID)){
-    ndiscordantCrossChr++;
+    ndiscordantCrossChr += sign;
   }
 
-  odd[al.Name]++;
+  tallyName(al.nameHash, sign);
   
-  clusterFrontOrBackPrimary(al, true, saTag);
+  clusterFrontOrBackPrimary(al, true, sign);
 
   return true;
 
 }
 
-bool readPileUp::processSplitRead(BamAlignment & al, string & saTag){
+bool readPileUp::processSplitRead(pileupRead & al, int sign){
 
-  vector<string> sas = split(saTag, ";");
-
-  if(sas.size() > 2){
+  if(al.saFields > 2){
     return true;
   }
 
-  odd[al.Name]++;
+  tallyName(al.nameHash, sign);
 
-  nsplitRead += 1;
+  nsplitRead += sign;
 
-  vector<string> saData = split(sas[0], ",");
+  // strand of the other fragment
+  bool plus = ! al.sa.empty() && al.sa[0].strand == '+';
   
   // checking if the two splitread fragments
   // are on the same strand
 
-  if(saData[2].compare("+") == 0){
+  if(plus){
     if(!al.IsReverseStrand() ){
-      nf1f2SameStrand += 1;
+      nf1f2SameStrand += sign;
     }
   }
   else{
     if(al.IsReverseStrand() ){
-      nf1f2SameStrand++;
+      nf1f2SameStrand += sign;
     }
   }
   
@@ -77,135 +211,111 @@ bool readPileUp::processSplitRead(BamAlignment & al, string & saTag){
     // against the mate pair
 
     if(sameStrand(al)){
-      nf1SameStrand++;
+      nf1SameStrand += sign;
     }
 
     // checking the second fragment
     // against the mate pair
 
-    if(saData[2].compare("+") == 0){
+    if(plus){
       if(!al.IsReverseStrand()){
-	nf2SameStrand++;
+	nf2SameStrand += sign;
       }
     }
     else{
-      nsplitMissingMates++;
+      nsplitMissingMates += sign;
     }
     
     // splitread translocation 
 
     if(al.RefID != al.MateRefID){
-      nsplitReadCrossChr++;
+      nsplitReadCrossChr += sign;
     }
   }
 
-  clusterFrontOrBackPrimary(al, false, saTag);
+  clusterFrontOrBackPrimary(al, false, sign);
   
   return true;
   
 }
 
 
-bool readPileUp::processMissingMate(BamAlignment & al, string & saTag){
+bool readPileUp::processMissingMate(pileupRead & al, int sign){
 
-  nMatesMissing++;
+  nMatesMissing += sign;
 
-  clusterFrontOrBackPrimary(al, true, saTag);
+  clusterFrontOrBackPrimary(al, true, sign);
 
-  odd[al.Name]++;
+  tallyName(al.nameHash, sign);
 
   return true;
 
 }
 
-bool readPileUp::processProperPair(BamAlignment & al, string & saTag){
+bool readPileUp::processProperPair(pileupRead & al, int sign){
 
-  nPaired++ ;
+  nPaired += sign;
 
   if(sameStrand(al)){
-    nSameStrand += 1;
-    odd[al.Name]++;
+    nSameStrand += sign;
+    tallyName(al.nameHash, sign);
   }
   if(al.RefID != al.MateRefID){
-    nCrossChr++;
-    odd[al.Name]++;
+    nCrossChr += sign;
+    tallyName(al.nameHash, sign);
   }
 
-  clusterFrontOrBackPrimary(al, true, saTag);
-
-  vector< CigarOp > cd = al.CigarData;
+  clusterFrontOrBackPrimary(al, true, sign);
 
-
-  for(vector< CigarOp >::iterator cig = cd.begin(); 
-      cig != cd.end(); cig++){
-
-    switch((*cig).Type){
-    case 'I':
-      {
-	if((*cig).Length > 25){
-	  internalInsertion += 1;
-	  odd[al.Name]++;
-	}
-	break;
-      }
-    case 'D':
-      {
-	if((*cig).Length > 25){
-	  internalDeletion += 1;
-	  odd[al.Name]++;
-	}
-	break;
-      }
-    default:
-      {
-      }
-    }
+  if(al.nLargeInsertion > 0){
+    internalInsertion += sign * al.nLargeInsertion;
+    tallyName(al.nameHash, sign * al.nLargeInsertion);
+  }
+  if(al.nLargeDeletion > 0){
+    internalDeletion  += sign * al.nLargeDeletion;
+    tallyName(al.nameHash, sign * al.nLargeDeletion);
   }
   
   return true;
 }
 
 
-bool readPileUp::clusterFrontOrBackPrimary(BamAlignment & al, bool p, string & saTag){
-
-  vector< CigarOp > cd = al.CigarData;  
+bool readPileUp::clusterFrontOrBackPrimary(pileupRead & al, bool p, int sign){
 
   if((al.AlignmentFlag & 0x0800) != 0){
-    if(cd.front().Type == 'H'){
-      allCount[al.Position]++;
-      supplementCount[al.Position]++;
-      supplement[al.Position].push_back(al);
+    if(al.frontType == 'H'){
+      tallyAll(al.Position, sign);
+      tallySupplementCount(al.Position, sign);
+      tallySupplement(al.Position, al, sign);
     }
-    if(cd.back().Type == 'H'){
-      allCount[al.Position]++;
-      supplementCount[al.Position]++;
-      supplement[al.GetEndPosition()].push_back(al);
+    if(al.backType == 'H'){
+      tallyAll(al.Position, sign);
+      tallySupplementCount(al.Position, sign);
+      tallySupplement(al.GetEndPosition(), al, sign);
     }
   }
 
   else{
-    if(cd.front().Type == 'S'){
-      nClippedFront++;
-      allCount[al.Position]++;
-      primaryCount[al.Position]++;
-      primary[al.Position].push_back(al);
+    if(al.frontType == 'S'){
+      nClippedFront += sign;
+      tallyAll(al.Position, sign);
+      tallyPrimary(al.Position, al, sign);
 
-      odd[al.Name]++;
+      tallyName(al.nameHash, sign);
 
-      if(! saTag.empty()){
-	supplement[al.Position].push_back(al);
+      if(al.saLength > 0){
+	tallySupplement(al.Position, al, sign);
       }
     }
-    if(cd.back().Type == 'S'){
-      nClippedBack++;
-      allCount[al.GetEndPosition()]++;
-      primaryCount[al.GetEndPosition()]++;
-      primary[al.GetEndPosition()].push_back(al);
+    if(al.backType == 'S'){
+      nClippedBack += sign;
+      tallyAll(al.GetEndPosition(), sign);
+      tallyPrimary(al.GetEndPosition(), al, sign);
 
-      odd[al.Name]++;
+      tallyName(al.nameHash, sign);
 
-      if(! saTag.empty()){
-	supplement[al.GetEndPosition()].push_back(al);
+      if(al.saLength > 0){
+	tallySupplement(al.GetEndPosition(), al, sign);
       }
     }
   }
@@ -213,91 +323,454 @@ bool readPileUp::clusterFrontOrBackPrimary(BamAlignment & al, bool p, string & s
 }
 
 void readPileUp::printPileUp(void){
-  for(list<BamAlignment>::iterator r = currentData.begin();
-      r != currentData.end(); r++){
-    cerr << (*r).Name 
+  for(unsigned int i = 0; i < count; i++){
+    pileupRead & r = at(i);
+    if(r.dead){
+      continue;
+    }
+    cerr << r.Name 
 	 << "\t"
-	 << (*r).Position
+	 << r.Position
 	 << "\t"
-	 << (*r).QueryBases
+	 << r.frontClip << "," << r.backClip
 	 << endl;
   }
 
 }
 
-void readPileUp::processPileup(long int * pos){
+// adds (sign 1) or removes (sign -1) everything one read contributes
 
-  clearClusters();
-  clearStats();
+void readPileUp::tally(pileupRead & r, int sign){
 
-  for(list<BamAlignment>::iterator r = currentData.begin(); 
-      r != currentData.end(); r++){
-  
-    // trailing pileup data
-    if((*r).Position > *pos){
-      continue;
+  numberOfReads += sign;
+
+  // split reads
+  if( r.hasSA ){
+    processSplitRead(r, sign);
 #ifdef DEBUG
-      cerr << "Too far ahead: " << (*r).Name << endl;
+    cerr << "Split Read: " << r.Name << endl;
+#endif
+    return;
+  }
+  // discordant reads
+  if(!r.IsProperPair()){
+    processDiscordant(r, sign);
+#ifdef DEBUG
+    cerr << "Discordant Read: " << r.Name << endl;
+#endif
+    return;
+  }
+  // mates missing
+  if(!r.IsMateMapped()){
+    processMissingMate(r, sign);
+#ifdef DEBUG
+    cerr << "Mate Missing: " << r.Name << endl;
+#endif
+    return;
+  }
+  // good data
+  if(r.IsMateMapped() && r.IsProperPair() ){
+    
+#ifdef DEBUG
+    cerr << "before count: " << nPaired << endl;
 #endif
-    }
-
-    numberOfReads += 1;
 
-    string saTag;
+    processProperPair(r, sign);
+#ifdef DEBUG
+    cerr << "Mate paired: " << r.Name << endl;
+    cerr << "after count: " << nPaired << endl;
+#endif
+    return;
+  }    
 
-    // split reads
-    if( (*r).GetTag("SA", saTag) ){
-      processSplitRead(*r, saTag);
 #ifdef DEBUG
-      cerr << "Split Read: " << (*r).Name << endl;
+  cerr << "Bleed through: " << r.Name << endl;
 #endif
+}
+
+void readPileUp::tallyName(uint64_t hash, int n){
+  if(n == 0){
+    return;
+  }
+  odd.add(hash, n);
+}
+
+// the cluster for pos, claiming its slot if it is free
+
+clipCluster & readPileUp::clusterAt(long int pos){
+
+  clipCluster * c = &clusters[pos & (clusters.size() - 1)];
+
+  if(c->pos != pos && c->pos >= 0){
+    growClusters(pos);
+    c = &clusters[pos & (clusters.size() - 1)];
+  }
+  c->pos = pos;
+  return *c;
+}
+
+clipCluster * readPileUp::cluster(long int pos){
+  clipCluster & c = clusters[pos & (clusters.size() - 1)];
+  if(c.pos != pos){
+    return NULL;
+  }
+  return &c;
+}
+
+// sizes the array to the span of the positions in use, so none collide
+
+void readPileUp::growClusters(long int pos){
+
+  long int lo = pos;
+  long int hi = pos;
+
+  for(vector<clipCluster>::iterator c = clusters.begin(); c != clusters.end(); c++){
+    if((*c).pos < 0){
       continue;
     }
-    // discordant reads
-    if(!(*r).IsProperPair()){
-      processDiscordant(*r, saTag);
+    lo = min(lo, (*c).pos);
+    hi = max(hi, (*c).pos);
+  }
+
+  unsigned long size = clusters.size();
+  while(size <= (unsigned long)(hi - lo)){
+    size *= 2;
+  }
+
+  vector<clipCluster> bigger(size);
+
+  for(vector<clipCluster>::iterator c = clusters.begin(); c != clusters.end(); c++){
+    if((*c).pos >= 0){
+      swap(bigger[(*c).pos & (size - 1)], *c);
+    }
+  }
+  clusters.swap(bigger);
+}
+
+// frees the slot once nothing points at the position any more
+
+void readPileUp::release(clipCluster & c){
+  if(c.nAll == 0 && c.nPrimary == 0 && c.nSupplement == 0
+     && c.primary.empty() && c.supplement.empty()){
+    c.pos = -1;
+  }
+}
+
+void readPileUp::tallyAll(long int pos, int sign){
+  clipCluster & c = clusterAt(pos);
+  if(c.nAll == 0){
+    nClusters += 1;
+  }
+  c.nAll += sign;
+  if(c.nAll == 0){
+    nClusters -= 1;
+  }
+  release(c);
+}
+
+void readPileUp::tallyPrimary(long int pos, pileupRead & r, int sign){
+  clipCluster & c = clusterAt(pos);
+  c.nPrimary += sign;
+  tallySeq(c.primary, r.seq, sign);
+  release(c);
+}
+
+void readPileUp::tallySupplementCount(long int pos, int sign){
+  clipCluster & c = clusterAt(pos);
+  c.nSupplement += sign;
+  release(c);
+}
+
+void readPileUp::tallySupplement(long int pos, pileupRead & r, int sign){
+  clipCluster & c = clusterAt(pos);
+  tallySeq(c.supplement, r.seq, sign);
+  release(c);
+}
+
+// reads leave a cluster newest first or in the middle, so the search
+// starts at the back
+
+void readPileUp::tallySeq(vector<unsigned long> & seqs, unsigned long seq, int sign){
+  if(sign > 0){
+    seqs.push_back(seq);
+    return;
+  }
+  for(unsigned int i = seqs.size(); i > 0; i--){
+    if(seqs[i - 1] == seq){
+      seqs.erase(seqs.begin() + (i - 1));
+      break;
+    }
+  }
+}
+
+// puts back the reads processPileup() took out
+
+void readPileUp::restore(void){
+  for(unsigned int i = trailing; i < count; i++){
+    if(! at(i).dead){
+      tally(at(i), 1);
+    }
+  }
+  trailing = count;
+}
+
+// rebuilds the counts from scratch, after the reads were renumbered
+
+void readPileUp::retally(void){
+  clearClusters();
+  clearStats();
+  for(unsigned int i = 0; i < count; i++){
+    if(! at(i).dead){
+      tally(at(i), 1);
+    }
+  }
+  trailing = count;
+}
+
+// the counts follow the window as reads come and go, so only the
+// trailing reads past pos are taken out here.  The input is sorted, so
+// they are the newest reads.
+
+void readPileUp::processPileup(long int * pos){
+
+  restore();
+
+  while(trailing > 0 && (at(trailing - 1).dead || at(trailing - 1).Position > *pos)){
+    trailing -= 1;
+  }
+  for(unsigned int i = count; i > trailing; i--){
+    if(! at(i - 1).dead){
 #ifdef DEBUG
-      cerr << "Discordant Read: " << (*r).Name << endl;
+      cerr << "Too far ahead: " << at(i - 1).Name << endl;
 #endif
-      continue;
+      tally(at(i - 1), -1);
     }
-    // mates missing
-    if(!(*r).IsMateMapped()){
-      processMissingMate(*r, saTag);
+  }
+
 #ifdef DEBUG
-      cerr << "Mate Missing: " << (*r).Name << endl;
+  checkTally(pos);
 #endif
-      continue;
+}
+
+// emitOffsets[m] lists the set bits of the 8 bit mask m, lowest first,
+// and emitCount[m] says how many there are.  A table beats popcount,
+// which is a library call unless the build targets a CPU with POPCNT.
+
+static uint8_t emitOffsets[256][8];
+static uint8_t emitCount[256];
+
+static bool fillEmitOffsets(void){
+  for(unsigned int m = 0; m < 256; m++){
+    unsigned int k = 0;
+    for(unsigned int b = 0; b < 8; b++){
+      if(m & (1 << b)){
+	emitOffsets[m][k++] = b;
+      }
     }
-    // good data
-    if((*r).IsMateMapped() && (*r).IsProperPair() ){
-      
-#ifdef DEBUG
-      cerr << "before count: " << nPaired << endl;
+    emitCount[m] = k;
+  }
+  return true;
+}
+
+static bool emitOffsetsReady = fillEmitOffsets();
+
+// writes first + b for every bit b set in the 8 bit mask m.  All eight
+// slots are written, so out needs room for eight.
+
+static inline unsigned int emit8(unsigned int m, unsigned int first, unsigned int * out){
+  const uint8_t * o = emitOffsets[m];
+  out[0] = first + o[0];
+  out[1] = first + o[1];
+  out[2] = first + o[2];
+  out[3] = first + o[3];
+  out[4] = first + o[4];
+  out[5] = first + o[5];
+  out[6] = first + o[6];
+  out[7] = first + o[7];
+  return emitCount[m];
+}
+
+// writes base + j for every live primary read j of the n slots at f and
+// p that starts at or before pos, and returns how many there were.  The
+// vector loops test 16 or 8 reads at once and turn the result into one
+// bit per read; out needs room for n + 8.
+
+static unsigned int selectPrimaries(const uint16_t * f,
+			    const int32_t  * p,
+			    unsigned int     n,
+			    int32_t          pos,
+			    unsigned int     base,
+			    unsigned int   * out){
+
+  const uint16_t skip = PILEUP_DEAD | 0x0800 | 0x0100;
+
+  unsigned int j = 0;
+  unsigned int k = 0;
+
+#if defined(__AVX2__)
+  __m256i skips = _mm256_set1_epi16(skip);
+  __m256i zero  = _mm256_setzero_si256();
+  __m256i limit = _mm256_set1_epi32(pos);
+
+  for(; j + 16 <= n; j += 16){
+    __m256i fl   = _mm256_loadu_si256((const __m256i *)(f + j));
+    __m256i ok   = _mm256_cmpeq_epi16(_mm256_and_si256(fl, skips), zero);
+    __m256i lo   = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(p + j)),     limit);
+    __m256i hi   = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(p + j + 8)), limit);
+    // packs works within 128 bit lanes, the permute puts reads back in order
+    __m256i late = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+    // reads 0-7 land in bytes 0-7 and reads 8-15 in bytes 16-23
+    uint32_t m   = _mm256_movemask_epi8(_mm256_packs_epi16(_mm256_andnot_si256(late, ok), zero));
+    k += emit8(m & 0xFF,         base + j,     out + k);
+    k += emit8((m >> 16) & 0xFF, base + j + 8, out + k);
+  }
 #endif
 
-      processProperPair(*r, saTag);
-#ifdef DEBUG
-      cerr << "Mate paired: " << (*r).Name << endl;
-      cerr << "after count: " << nPaired << endl;
+#if defined(__SSE2__)
+  __m128i skips8 = _mm_set1_epi16(skip);
+  __m128i zero8  = _mm_setzero_si128();
+  __m128i limit8 = _mm_set1_epi32(pos);
+
+  for(; j + 8 <= n; j += 8){
+    __m128i fl   = _mm_loadu_si128((const __m128i *)(f + j));
+    __m128i ok   = _mm_cmpeq_epi16(_mm_and_si128(fl, skips8), zero8);
+    __m128i lo   = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(p + j)),     limit8);
+    __m128i hi   = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(p + j + 4)), limit8);
+    __m128i late = _mm_packs_epi32(lo, hi);
+    uint32_t m   = _mm_movemask_epi8(_mm_packs_epi16(_mm_andnot_si128(late, ok), zero8));
+    k += emit8(m & 0xFF, base + j, out + k);
+  }
 #endif
+
+  for(; j < n; j++){
+    if((f[j] & skip) == 0 && p[j] <= pos){
+      out[k++] = base + j;
+    }
+  }
+  return k;
+}
+
+// the reads scored at pos: live, primary, not supplementary and starting
+// at or before pos, as offsets for at().  The live reads wrap around the
+// end of the ring at most once.
+
+void readPileUp::findPrimaries(long int pos){
+
+  if(primaries.size() < count + 16){
+    primaries.resize(ring.size() + 16);
+  }
+
+  unsigned int start = slot(0);
+  unsigned int n     = min((unsigned long) count, (unsigned long)(ring.size() - start));
+
+  nPrimaries  = selectPrimaries(&flags[start], &positions[start], n, pos, 0, &primaries[0]);
+  nPrimaries += selectPrimaries(&flags[0], &positions[0], count - n, pos, n, &primaries[nPrimaries]);
+}
+
+int readPileUp::nPrimary(long int pos){
+  clipCluster * c = cluster(pos);
+  if(c == NULL){
+    return 0;
+  }
+  return c->nPrimary;
+}
+
+int readPileUp::nSupplement(long int pos){
+  clipCluster * c = cluster(pos);
+  if(c == NULL){
+    return 0;
+  }
+  return c->nSupplement;
+}
+
+// compares the running counts with a full pass over the window
+
+bool readPileUp::checkTally(long int * pos){
+
+  readPileUp full;
+
+  full.clearStats();
+
+  for(unsigned int i = 0; i < count; i++){
+    pileupRead & r = at(i);
+    if(r.dead || r.Position > *pos){
       continue;
-    }    
-  
-#ifdef DEBUG
-    cerr << "Bleed through: " << (*r).Name << endl;
-#endif
-    
+    }
+    full.tally(r, 1);
+  }
+
+  bool same = full.odd == odd
+    && full.nClusters       == nClusters
+    && full.numberOfReads   == numberOfReads
+    && full.nPaired         == nPaired
+    && full.nMatesMissing   == nMatesMissing
+    && full.nSameStrand     == nSameStrand
+    && full.nCrossChr       == nCrossChr
+    && full.nsplitRead      == nsplitRead
+    && full.nf1SameStrand   == nf1SameStrand
+    && full.nf2SameStrand   == nf2SameStrand
+    && full.nf1f2SameStrand == nf1f2SameStrand
+    && full.nsplitReadCrossChr    == nsplitReadCrossChr
+    && full.nsplitMissingMates    == nsplitMissingMates
+    && full.nDiscordant           == nDiscordant
+    && full.nsameStrandDiscordant == nsameStrandDiscordant
+    && full.ndiscordantCrossChr   == ndiscordantCrossChr
+    && full.internalInsertion     == internalInsertion
+    && full.internalDeletion      == internalDeletion
+    && full.nClippedFront == nClippedFront
+    && full.nClippedBack  == nClippedBack;
+
+  for(unsigned int i = 0; i < count; i++){
+    if(positions[slot(i)] != at(i).Position
+       || flags[slot(i)] != (at(i).AlignmentFlag | (at(i).dead ? PILEUP_DEAD : 0))){
+      same = false;
+    }
+  }
+
+  int nUsed = 0;
+
+  for(vector<clipCluster>::iterator c = clusters.begin(); c != clusters.end(); c++){
+    if((*c).pos < 0){
+      continue;
+    }
+    nUsed += 1;
+    clipCluster * o = full.cluster((*c).pos);
+    if(o == NULL
+       || o->nAll        != (*c).nAll
+       || o->nPrimary    != (*c).nPrimary
+       || o->nSupplement != (*c).nSupplement
+       || o->primary     != (*c).primary
+       || o->supplement  != (*c).supplement){
+      same = false;
+    }
   }
+  for(vector<clipCluster>::iterator c = full.clusters.begin(); c != full.clusters.end(); c++){
+    if((*c).pos >= 0){
+      nUsed -= 1;
+    }
+  }
+  if(nUsed != 0){
+    same = false;
+  }
+
+  if(! same){
+    cerr << "FATAL: running pileup counts differ from a full recount at: " << *pos << endl;
+    exit(1);
+  }
+  return true;
 }
 
 void readPileUp::clearClusters(void){
   odd.clear();
-  primaryCount.clear();
-  supplementCount.clear();
-  primary.clear();
-  supplement.clear();
-  allCount.clear();
+  for(vector<clipCluster>::iterator c = clusters.begin(); c != clusters.end(); c++){
+    (*c).pos         = -1;
+    (*c).nAll        = 0;
+    (*c).nPrimary    = 0;
+    (*c).nSupplement = 0;
+    (*c).primary.clear();
+    (*c).supplement.clear();
+  }
+  nClusters = 0;
 }
 
 void readPileUp::clearStats(void){
@@ -326,46 +799,281 @@ void readPileUp::clearStats(void){
 readPileUp::readPileUp(){
   CurrentPos   = 0;
   CurrentStart = 0;
+  first        = 0;
+  count        = 0;
+  nDead        = 0;
+  trailing     = 0;
+  nPrimaries   = 0;
+  ring.resize(1024);
+  flags.resize(1024);
+  positions.resize(1024);
+  clusters.resize(1024);
+  nClusters    = 0;
+  longest      = 0;
+  clearStats();
 }
 
 readPileUp::~readPileUp(){}
 
-void readPileUp::processAlignment(BamTools::BamAlignment Current_alignment, long int pos){
-  currentData.push_back(Current_alignment);
-  CurrentStart    = Current_alignment.Position;
-  CurrentPos      = pos;
+// doubles the ring.  The kept reads span fewer read numbers than the old
+// ring has slots, so every read keeps its number and ends and the
+// clusters stay valid.
+
+void readPileUp::grow(void){
+
+  vector<pileupRead> bigger(ring.size() * 2);
+  vector<uint16_t>   biggerFlags(bigger.size());
+  vector<int32_t>    biggerPositions(bigger.size());
+
+  for(unsigned int i = 0; i < count; i++){
+    unsigned int s = (first + i) & (bigger.size() - 1);
+    biggerFlags[s]     = flags[slot(i)];
+    biggerPositions[s] = positions[slot(i)];
+    swap(bigger[s], at(i));
+  }
+  ring.swap(bigger);
+  flags.swap(biggerFlags);
+  positions.swap(biggerPositions);
 }
 
-void readPileUp::purgeAll(void){
-  currentData.clear();
+// squeezes out dead reads left behind a long lived one and renumbers
+// the rest; the caller rebuilds the clusters
+
+void readPileUp::compact(void){
+
+  unsigned int kept = 0;
+
+  for(unsigned int i = 0; i < count; i++){
+    if(! at(i).dead){
+      if(kept != i){
+	swap(at(kept), at(i));
+	flags[slot(kept)]     = flags[slot(i)];
+	positions[slot(kept)] = positions[slot(i)];
+      }
+      kept += 1;
+    }
+  }
+
+  count = kept;
+  nDead = 0;
+
+  ends.clear();
+  for(unsigned int i = 0; i < count; i++){
+    at(i).seq = first + i;
+    pileupEnd e;
+    e.end = at(i).EndPosition;
+    e.seq = at(i).seq;
+    ends.push_back(e);
+  }
+  make_heap(ends.begin(), ends.end());
 }
 
+int32_t readPileUp::saRef(const strView & name){
+  for(unsigned int i = 0; i < saRefs.size(); i++){
+    if(saRefs[i].size() == name.size() && memcmp(saRefs[i].data(), name.b, name.size()) == 0){
+      return i;
+    }
+  }
+  saRefs.push_back(name.str());
+  return saRefs.size() - 1;
+}
 
-void readPileUp::purgePast(void){
-  
-  int nreads  = currentData.size();
-  int counter = 0;
-  
-  while (!currentData.empty()) {
-    
-    BamAlignment read = currentData.front();
-    currentData.pop_front();    
-
-    if( read.GetEndPosition() >= CurrentPos){ 
-      currentData.push_back(read);
-    } 
-   
-    counter += 1;
-    
-    if(counter == nreads){
+// fills r.sa from the text of the tag.  Like the old split() on ';' it
+// stops at the first empty field, and alignments with fewer than four
+// fields end it too.  The end position counts M and I, the way
+// otherBreak() always did.
+
+void readPileUp::parseSA(pileupRead & r, const strView & text){
+
+  r.sa.clear();
+  r.saLength = text.size();
+  r.saFields = countFields(text, ';');
+
+  fieldIter alignments(text, ';');
+  strView   one;
+
+  while(alignments.next(one)){
+
+    if(one.empty()){
       break;
     }
+
+    // rname,pos,strand,CIGAR,mapQ,NM
+    fieldIter fields(one, ',');
+    strView   f[6];
+    int       nf = 0;
+
+    while(nf < 6 && fields.next(f[nf])){
+      nf++;
+    }
+    if(nf < 4){
+      break;
+    }
+
+    saAlignment a;
+
+    a.ref       = saRef(f[0]);
+    a.pos       = parseInt(f[1]);
+    a.strand    = f[2].size() == 1 ? *f[2].b : 0;
+    a.mapq      = nf > 4 ? parseInt(f[4]) : 0;
+    a.nm        = nf > 5 ? parseInt(f[5]) : 0;
+    a.end       = a.pos;
+    a.frontType = 0;
+    a.backType  = 0;
+
+    const char * number = f[3].b;
+
+    for(const char * c = f[3].b; c < f[3].e; c++){
+      switch(*c){
+      case 'M':
+      case 'I':
+      case 'D':
+      case 'N':
+      case 'S':
+      case 'H':
+      case 'P':
+      case 'X':
+      case '=':
+	{
+	  if(*c == 'M' || *c == 'I'){
+	    a.end += parseInt(strView(number, c));
+	  }
+	  if(a.frontType == 0){
+	    a.frontType = *c;
+	  }
+	  a.backType = *c;
+	  number = c + 1;
+	  break;
+	}
+      default:
+	break;
+      }
+    }
+
+    r.sa.push_back(a);
+  }
+}
+
+void readPileUp::processAlignment(BamTools::BamAlignment & al, long int pos, uint16_t sample){
+
+  restore();
+
+  if(count == ring.size()){
+    if(nDead > count / 2){
+      compact();
+      retally();
+    }
+    else{
+      grow();
+    }
   }
+
+  pileupRead & r = at(count);
+  flags[slot(count)]     = al.AlignmentFlag;
+  positions[slot(count)] = al.Position;
+  count += 1;
+
+  r.dead          = false;
+  r.seq           = first + count - 1;
+
+  r.Name          = al.Name;
+  r.nameHash      = hashName(al.Name);
+  r.RefID         = al.RefID;
+  r.Position      = al.Position;
+  r.EndPosition   = al.GetEndPosition();
+  longest         = max(longest, r.EndPosition - r.Position);
+  r.MateRefID     = al.MateRefID;
+  r.MatePosition  = al.MatePosition;
+  r.InsertSize    = al.InsertSize;
+  r.Length        = al.Length;
+  r.AlignmentFlag = al.AlignmentFlag;
+  r.MapQuality    = al.MapQuality;
+  r.sample        = sample;
+
+  strView saTag;
+  r.hasSA = findStringTag(al.TagData, "SA", saTag);
+  parseSA(r, saTag);
+
+  const vector<CigarOp> & cd = al.CigarData;
+
+  r.frontType   = cd.front().Type;
+  r.frontLength = cd.front().Length;
+  r.backType    = cd.back().Type;
+  r.backLength  = cd.back().Length;
+
+  r.frontClip.clear();
+  r.backClip.clear();
+
+  if(r.frontType == 'S'){
+    r.frontClip.assign(al.QueryBases, 0, r.frontLength);
+  }
+  if(r.backType == 'S' && (uint32_t) al.Length >= r.backLength){
+    r.backClip.assign(al.QueryBases, al.Length - r.backLength, string::npos);
+  }
+
+  r.nLargeInsertion = 0;
+  r.nLargeDeletion  = 0;
+
+  for(vector<CigarOp>::const_iterator cig = cd.begin(); cig != cd.end(); cig++){
+    if((*cig).Length <= 25){
+      continue;
+    }
+    if((*cig).Type == 'I'){
+      r.nLargeInsertion++;
+    }
+    if((*cig).Type == 'D'){
+      r.nLargeDeletion++;
+    }
+  }
+
+  pileupEnd e;
+  e.end = r.EndPosition;
+  e.seq = r.seq;
+  ends.push_back(e);
+  push_heap(ends.begin(), ends.end());
+
+  tally(r, 1);
+  trailing = count;
+
+  CurrentStart    = al.Position;
+  CurrentPos      = pos;
 }
 
-std::list<BamAlignment> readPileUp::pileup(void){
-  readPileUp::purgePast();
-  return currentData;
+void readPileUp::purgeAll(void){
+  first   += count;
+  count    = 0;
+  nDead    = 0;
+  trailing = 0;
+  ends.clear();
+  clearClusters();
+  clearStats();
+}
+
+// drops the reads that end before CurrentPos.  Only the expired reads are
+// touched; they are marked dead and their slots are freed once they reach
+// the front of the ring.
+
+void readPileUp::purgePast(void){
+
+  restore();
+
+  while(! ends.empty() && ends.front().end < CurrentPos){
+    unsigned int  s = ends.front().seq & (ring.size() - 1);
+    pileupRead & r = ring[s];
+    tally(r, -1);
+    r.dead = true;
+    flags[s] |= PILEUP_DEAD;
+    nDead += 1;
+    pop_heap(ends.begin(), ends.end());
+    ends.pop_back();
+  }
+
+  while(count > 0 && at(0).dead){
+    first    += 1;
+    count    -= 1;
+    nDead    -= 1;
+  }
+  trailing = count;
 }
 
 int readPileUp::currentPos(void){
@@ -377,5 +1085,37 @@ int readPileUp::currentStart(void){
 }
 
 int readPileUp::nReads(void){
-  return currentData.size();
+  return count - nDead;
+}
+
+// the splitmix64 finalizer over h and v
+
+uint64_t mixPrint(uint64_t h, uint64_t v){
+  uint64_t z = h ^ (v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2));
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// a hash of the live reads in the order they were added and of the
+// position being scored.  Everything the statistics and clusters hold
+// follows from these, so two pileups fed the same reads from different
+// starting points have converged once their fingerprints agree.
+
+uint64_t readPileUp::fingerprint(void){
+
+  uint64_t h = mixPrint(count - nDead, CurrentPos);
+
+  h = mixPrint(h, CurrentStart);
+
+  for(unsigned int i = 0; i < count; i++){
+    pileupRead & r = at(i);
+    if(r.dead){
+      continue;
+    }
+    h = mixPrint(h, r.nameHash);
+    h = mixPrint(h, ((uint64_t)(uint32_t) r.Position << 32) | (uint32_t) r.EndPosition);
+    h = mixPrint(h, ((uint64_t) r.AlignmentFlag << 32) | ((uint64_t) r.sample << 8) | r.MapQuality);
+  }
+  return h;
 }
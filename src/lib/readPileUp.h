@@ -13,25 +13,184 @@
 #include  "api/BamReader.h"
 #include  "split.h"
 
-#include <list>
+#include <stdint.h>
 #include <map>
 #include <vector>
 
+// mixes v into the 64 bit hash h, for fingerprints
+
+uint64_t mixPrint(uint64_t h, uint64_t v);
+
+// set in readPileUp::flags for expired reads; BAM flags stop at 0x0800
+
+#define PILEUP_DEAD 0x8000
+
+// read names that picked up an odd count, by 64 bit hash of the name.
+// Open addressing with linear probing; 0 marks an empty slot.
+
+class nameCounts {
+
+ public:
+
+  std::vector<uint64_t> keys  ;
+  std::vector<int>      counts;
+  unsigned int          used  ;
+
+  nameCounts();
+
+  void add(uint64_t, int);
+  bool has(uint64_t);
+  int  count(uint64_t);
+  void clear(void);
+  bool operator==(nameCounts &);
+
+ private:
+
+  unsigned int slot(uint64_t);
+  void grow(void);
+};
+
+// reads ordered by end position, for purgePast()
+
+struct pileupEnd {
+  int32_t       end;
+  unsigned long seq;
+  bool operator<(const pileupEnd & o) const { return end > o.end; }
+};
+
+// one alignment of an SA tag (rname,pos,strand,CIGAR,mapQ,NM;), parsed
+// when the read enters the pileup.  Of the CIGAR only what WHAM uses is
+// kept: the first and last operation and where the alignment ends.
+
+struct saAlignment {
+  int32_t  ref      ; // index into readPileUp::saRefs
+  int32_t  pos      ; // as written in the tag
+  int32_t  end      ; // pos plus the M and I operations
+  char     strand   ;
+  char     frontType;
+  char     backType ;
+  uint8_t  mapq     ;
+  int32_t  nm       ;
+};
+
+// the parts of a BamAlignment WHAM looks at once a read is in the
+// pileup.  Only the soft clipped bases are kept, not the whole read.
+
+struct pileupRead {
+
+  std::string Name     ;
+  uint64_t    nameHash ;
+  std::string frontClip;
+  std::string backClip ;
+
+  int32_t  RefID       ;
+  int32_t  Position    ;
+  int32_t  EndPosition ;
+  int32_t  MateRefID   ;
+  int32_t  MatePosition;
+  int32_t  InsertSize  ;
+  int32_t  Length      ;
+
+  uint16_t AlignmentFlag;
+  uint16_t sample       ; // position in the file list
+  uint8_t  MapQuality   ;
+
+  // first and last CIGAR operation
+  char     frontType  ;
+  char     backType   ;
+  uint32_t frontLength;
+  uint32_t backLength ;
+
+  // insertions and deletions longer than 25bp
+  uint8_t  nLargeInsertion;
+  uint8_t  nLargeDeletion ;
+
+  // the SA tag: whether there is one, how long it is, how many ';'
+  // separated fields it has and the alignments up to the first empty one
+  bool     hasSA   ;
+  uint32_t saLength;
+  uint32_t saFields;
+  std::vector<saAlignment> sa;
+
+  // expired, waiting for the front of the ring to pass it
+  bool     dead ;
+
+  // number of the read in the ring, see readPileUp
+  unsigned long seq;
+
+  bool IsMapped(void)            const { return (AlignmentFlag & 0x0004) == 0; }
+  bool IsMateMapped(void)        const { return (AlignmentFlag & 0x0008) == 0; }
+  bool IsProperPair(void)        const { return (AlignmentFlag & 0x0002) != 0; }
+  bool IsReverseStrand(void)     const { return (AlignmentFlag & 0x0010) != 0; }
+  bool IsMateReverseStrand(void) const { return (AlignmentFlag & 0x0020) != 0; }
+  bool IsPrimaryAlignment(void)  const { return (AlignmentFlag & 0x0100) == 0; }
+  bool IsSupplementary(void)     const { return (AlignmentFlag & 0x0800) != 0; }
+  int  GetEndPosition(void)      const { return EndPosition; }
+};
+
+// clipped reads at one reference position, kept by read number
+
+struct clipCluster {
+  long int pos        ;
+  int      nAll       ;
+  int      nPrimary   ;
+  int      nSupplement;
+  std::vector<unsigned long> primary   ;
+  std::vector<unsigned long> supplement;
+
+  clipCluster() : pos(-1), nAll(0), nPrimary(0), nSupplement(0) {}
+};
+
 class readPileUp {
-    
+
  public:
 
   int  CurrentId;
   long int  CurrentPos;
   long int  CurrentStart;
-  std::list <BamTools::BamAlignment> currentData;
 
-  std::map <std::string, int> odd;
-  std::map <long int, int > primaryCount, supplementCount, allCount;
-  std::map <long int, std::vector<BamTools::BamAlignment> > primary, supplement;
+  // reads in the order they were added.  Read number seq lives in
+  // ring[seq & (ring.size() - 1)] and first is the oldest one kept.
+  // Slots are reused, so their strings keep their capacity.
+  std::vector<pileupRead> ring;
+  unsigned long first;
+  unsigned int  count;
+  unsigned int  nDead;
+
+  // the flags (plus PILEUP_DEAD) and position of every slot of ring, so
+  // scans over the window need not load the read records
+  std::vector<uint16_t> flags    ;
+  std::vector<int32_t>  positions;
+
+  // the first nPrimaries are set by findPrimaries(), the rest is scratch
+  std::vector<unsigned int> primaries;
+  unsigned int nPrimaries;
+
+  // min-heap on end position, so purging only touches expired reads
+  std::vector<pileupEnd> ends;
+
+  // the statistics and clusters below always cover the live reads,
+  // except reads from trailing on, which processPileup() set aside
+  // because they start past the position being scored
+  unsigned int trailing;
+
+  nameCounts odd;
+
+  // reference names seen in SA tags, by saAlignment::ref
+  std::vector<std::string> saRefs;
+
+  // clusters[pos & (clusters.size() - 1)].  Every position in use lies
+  // within the span of the live reads, and the array is sized to it.
+  std::vector<clipCluster> clusters;
+
+  // positions with clipped reads, was allCount.size()
+  int nClusters;
 
   int numberOfReads;
 
+  // the longest reference span of any read added, for halos
+  int32_t longest;
+
   // internal shit
   int internalInsertion;
   int internalDeletion ;
@@ -58,29 +217,62 @@ class readPileUp {
   int nSoftClipped ;
   int nClippedFront;
   int nClippedBack ;
-  
+
   readPileUp() ;
   ~readPileUp();
 
-  bool clusterFrontOrBackPrimary(BamTools::BamAlignment &, bool, std::string&);
-  bool processSplitRead(BamTools::BamAlignment&, std::string&);
-  bool processDiscordant(BamTools::BamAlignment &, std::string&);
-  bool processSupplement(BamTools::BamAlignment &, std::string&);
-  bool processMissingMate(BamTools::BamAlignment &, std::string&);
-  bool processProperPair(BamTools::BamAlignment &, std::string&);
+  unsigned int slot(unsigned int i){
+    return (first + i) & (ring.size() - 1);
+  }
+
+  // the i-th oldest slot; check dead before using it
+  pileupRead & at(unsigned int i){
+    return ring[slot(i)];
+  }
+
+  pileupRead & bySeq(unsigned long seq){
+    return ring[seq & (ring.size() - 1)];
+  }
 
-  void processAlignment( BamTools::BamAlignment, long int);
+  bool clusterFrontOrBackPrimary(pileupRead &, bool, int);
+  bool processSplitRead(pileupRead &, int);
+  bool processDiscordant(pileupRead &, int);
+  bool processMissingMate(pileupRead &, int);
+  bool processProperPair(pileupRead &, int);
+
+  void tally(pileupRead &, int);
+  void tallyName(uint64_t, int);
+  void tallyAll(long int, int);
+  void tallyPrimary(long int, pileupRead &, int);
+  void tallySupplementCount(long int, int);
+  void tallySupplement(long int, pileupRead &, int);
+  void tallySeq(std::vector<unsigned long> &, unsigned long, int);
+  clipCluster & clusterAt(long int);
+  clipCluster * cluster(long int);
+  void growClusters(long int);
+  void release(clipCluster &);
+  void restore(void);
+  void retally(void);
+  bool checkTally(long int *);
+  int  nPrimary(long int);
+  int  nSupplement(long int);
+
+  void processAlignment(BamTools::BamAlignment &, long int, uint16_t);
+  void parseSA(pileupRead &, const strView &);
+  int32_t saRef(const strView &);
   void processPileup(long int *);
+  void findPrimaries(long int);
   void printPileUp(void);
   void purgeAll(void);
   void purgePast(void);
   void clearStats(void);
   void clearClusters(void);
-  std::list<BamTools::BamAlignment> pileup(void);
+  void grow(void);
+  void compact(void);
   int  currentPos(void);
   int  currentStart(void);
   int  nReads(void);
+  uint64_t fingerprint(void);
 };
 
 #endif
-
@@ -0,0 +1,103 @@
+//
+//  readerPool.cpp
+//  wham
+//
+
+#include "readerPool.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <omp.h>
+
+using namespace std;
+using namespace BamTools;
+
+readerPool::readerPool(vector<string> & f){
+  files = f;
+  readers.resize(omp_get_max_threads(), NULL);
+  nRegions.resize(omp_get_max_threads(), 0);
+}
+
+readerPool::~readerPool(){
+  closeAll();
+}
+
+bool readerPool::open(bamMultiStream & reader){
+
+  if(!reader.open(files)){
+    cerr << "FATAL: unable to open BAMs or indices: " << reader.streams.back()->path << endl;
+    cerr << "INFO : try using less CPUs in the -x option" << endl;
+    exit(1);
+  }
+  return true;
+}
+
+bamMultiStream * readerPool::region(int seqidIndex, int start, int end){
+
+  int t = omp_get_thread_num();
+
+  if(readers[t] == NULL){
+    readers[t] = new bamMultiStream;
+    open(*readers[t]);
+  }
+
+  nRegions[t] += 1;
+
+  if(!readers[t]->setRegion(seqidIndex, start, end)){
+    return NULL;
+  }
+  return readers[t];
+}
+
+void readerPool::closeAll(void){
+  for(unsigned int t = 0; t < readers.size(); t++){
+    if(readers[t] != NULL){
+      delete readers[t];
+      readers[t] = NULL;
+    }
+  }
+}
+
+long int readerPool::nOpened(void){
+  long int n = 0;
+  for(unsigned int t = 0; t < readers.size(); t++){
+    if(readers[t] != NULL){
+      n += 1;
+    }
+  }
+  return n;
+}
+
+long int readerPool::nServed(void){
+  long int n = 0;
+  for(unsigned int t = 0; t < nRegions.size(); t++){
+    n += nRegions[t];
+  }
+  return n;
+}
+
+// every region used to open every BAM and its index
+
+long int readerPool::nSaved(void){
+  return (nServed() - nOpened()) * files.size();
+}
+
+long int readerPool::nDecoded(void){
+  long int n = 0;
+  for(unsigned int t = 0; t < readers.size(); t++){
+    if(readers[t] != NULL){
+      n += readers[t]->nCore;
+    }
+  }
+  return n;
+}
+
+long int readerPool::nBuilt(void){
+  long int n = 0;
+  for(unsigned int t = 0; t < readers.size(); t++){
+    if(readers[t] != NULL){
+      n += readers[t]->nChars;
+    }
+  }
+  return n;
+}
@@ -0,0 +1,47 @@
+//
+//  readerPool.h
+//  wham
+//
+
+#ifndef readerPool_h
+#define readerPool_h
+
+#include  "bamStream.h"
+
+#include <string>
+#include <vector>
+
+// one long lived reader per OpenMP thread.  Opening every BAM (header +
+// index) for each 1Mb chunk dominated runtime for large cohorts, so each
+// thread opens the files once and only re-seeks.  The indices themselves
+// are shared by all threads through indexCache.
+
+class readerPool {
+
+ public:
+
+  std::vector<std::string> files;
+
+  // indexed by omp_get_thread_num()
+  std::vector<bamMultiStream *> readers;
+  std::vector<long int> nRegions;
+
+  readerPool(std::vector<std::string> &);
+  ~readerPool();
+
+  // opens the calling thread's reader on first use, then seeks it
+  bamMultiStream * region(int, int, int);
+
+  bool open(bamMultiStream &);
+  void closeAll(void);
+
+  long int nOpened(void);
+  long int nServed(void);
+  long int nSaved(void);
+
+  // records decoded to the core, and those that also got strings and tags
+  long int nDecoded(void);
+  long int nBuilt(void);
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "split.h"
 
+#include <ctype.h>
+
 
 std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
     std::string delims = std::string(1, delim);
@@ -21,3 +23,31 @@ std::vector<std::string> split(const std::string &s, const std::string& delims)
     std::vector<std::string> elems;
     return split(s, delims, elems);
 }
+
+unsigned int countFields(const strView & s, char delim) {
+    unsigned int n = 1;
+    for(const char * c = s.b; c < s.e; c++){
+	if(*c == delim){
+	    n += 1;
+	}
+    }
+    return n;
+}
+
+long int parseInt(const strView & s) {
+    const char * c = s.b;
+    while(c < s.e && isspace(*c)){
+	c++;
+    }
+    bool neg = false;
+    if(c < s.e && (*c == '-' || *c == '+')){
+	neg = *c == '-';
+	c++;
+    }
+    long int n = 0;
+    while(c < s.e && *c >= '0' && *c <= '9'){
+	n = n * 10 + (*c - '0');
+	c++;
+    }
+    return neg ? -n : n;
+}
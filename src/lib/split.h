@@ -17,6 +17,71 @@ std::vector<std::string>  split(const std::string &s, char delim);
 std::vector<std::string>& split(const std::string &s, const std::string& delims, std::vector<std::string> &elems);
 std::vector<std::string>  split(const std::string &s, const std::string& delims);
 
+// the characters [b, e) of a string that is not copied
+
+struct strView {
+    const char * b;
+    const char * e;
+
+    strView() : b(NULL), e(NULL) {}
+    strView(const char * begin, const char * end) : b(begin), e(end) {}
+
+    size_t      size(void)  const { return e - b; }
+    bool        empty(void) const { return b == e; }
+    std::string str(void)   const { return std::string(b, e); }
+};
+
+// walks the same fields split() returns, as views into the original
+// buffer, so nothing is allocated:
+//
+//   fieldIter it(s, ';');
+//   strView   field;
+//   while(it.next(field)){ ... }
+
+class fieldIter {
+
+ public:
+
+    fieldIter(const char * begin, const char * end, char delim)
+	: p(begin), e(end), d(delim), done(false) {}
+    fieldIter(const strView & s, char delim)
+	: p(s.b), e(s.e), d(delim), done(false) {}
+    fieldIter(const std::string & s, char delim)
+	: p(s.data()), e(s.data() + s.size()), d(delim), done(false) {}
+
+    bool next(strView & field){
+	if(done){
+	    return false;
+	}
+	const char * stop = p;
+	while(stop < e && *stop != d){
+	    stop++;
+	}
+	field.b = p;
+	field.e = stop;
+	if(stop == e){
+	    done = true;
+	}
+	else{
+	    p = stop + 1;
+	}
+	return true;
+    }
+
+ private:
+
+    const char * p;
+    const char * e;
+    char         d;
+    bool         done;
+};
+
+// the number of fields split() would return for s
+unsigned int countFields(const strView & s, char delim);
+
+// the integer at the front of s, read the way atoi() reads it
+long int parseInt(const strView & s);
+
 // from Marius, http://stackoverflow.com/a/1493195/238609
 template < class ContainerT >
 void tokenize(const std::string& str, ContainerT& tokens,
@@ -0,0 +1,210 @@
+//
+//  tbiIndex.cpp
+//  wham
+//
+
+#include "tbiIndex.h"
+#include "bgzf.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+using namespace std;
+
+// smallest bin holding [beg, end), straight from the SAM spec
+
+static uint32_t reg2bin(uint32_t beg, uint32_t end){
+  --end;
+  if(beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+  if(beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+  if(beg >> 20 == end >> 20) return ((1 <<  9) - 1) / 7 + (beg >> 20);
+  if(beg >> 23 == end >> 23) return ((1 <<  6) - 1) / 7 + (beg >> 23);
+  if(beg >> 26 == end >> 26) return ((1 <<  3) - 1) / 7 + (beg >> 26);
+  return 0;
+}
+
+void tbiIndex::init(const vector<string> & refNames){
+  names = refNames;
+  refs.clear();
+  refs.resize(names.size());
+}
+
+// a record that starts where the last chunk of its bin ends extends it
+
+void tbiIndex::add(int ref, uint32_t beg, uint32_t end, uint64_t vBeg, uint64_t vEnd){
+
+  tbiReference & r = refs[ref];
+
+  vector<baiChunk> & chunks = r.bins[reg2bin(beg, end)];
+
+  if(!chunks.empty() && chunks.back().end == vBeg){
+    chunks.back().end = vEnd;
+  }
+  else{
+    baiChunk c;
+    c.beg = vBeg;
+    c.end = vEnd;
+    chunks.push_back(c);
+  }
+
+  uint32_t first = beg >> BAI_LINEAR_SHIFT;
+  uint32_t last  = (end - 1) >> BAI_LINEAR_SHIFT;
+
+  if(r.linear.size() <= last){
+    r.linear.resize(last + 1, 0);
+  }
+  for(uint32_t w = first; w <= last; w++){
+    if(r.linear[w] == 0){
+      r.linear[w] = vBeg;
+    }
+  }
+}
+
+static void putInt(string & out, uint32_t v){
+  for(int i = 0; i < 4; i++){
+    out.push_back((char)((v >> (8 * i)) & 0xFF));
+  }
+}
+
+static void putLong(string & out, uint64_t v){
+  putInt(out, (uint32_t)(v & 0xFFFFFFFF));
+  putInt(out, (uint32_t)(v >> 32));
+}
+
+// windows without a record take the offset of the window before them,
+// as tabix does
+
+void tbiIndex::fillLinear(void){
+  for(vector<tbiReference>::iterator r = refs.begin(); r != refs.end(); r++){
+    uint64_t previous = 0;
+    for(vector<uint64_t>::iterator l = (*r).linear.begin(); l != (*r).linear.end(); l++){
+      if(*l == 0){
+	*l = previous;
+      }
+      previous = *l;
+    }
+  }
+}
+
+// the VCF preset of tabix: sequence in column 1, start in column 2,
+// the end from REF, '#' lines skipped
+
+bool tbiIndex::write(const string & path){
+
+  fillLinear();
+
+  string raw;
+
+  raw.append("TBI\1", 4);
+  putInt(raw, names.size());
+  putInt(raw, 2);   // format: VCF
+  putInt(raw, 1);   // sequence column
+  putInt(raw, 2);   // start column
+  putInt(raw, 0);   // end column
+  putInt(raw, '#'); // header lines
+  putInt(raw, 0);   // lines to skip
+
+  uint32_t nameLength = 0;
+  for(vector<string>::iterator n = names.begin(); n != names.end(); n++){
+    nameLength += (*n).size() + 1;
+  }
+  putInt(raw, nameLength);
+  for(vector<string>::iterator n = names.begin(); n != names.end(); n++){
+    raw.append((*n).c_str(), (*n).size() + 1);
+  }
+
+  for(vector<tbiReference>::iterator r = refs.begin(); r != refs.end(); r++){
+
+    putInt(raw, (*r).bins.size());
+
+    for(map<uint32_t, vector<baiChunk> >::iterator b = (*r).bins.begin(); b != (*r).bins.end(); b++){
+      putInt(raw, b->first);
+      putInt(raw, b->second.size());
+      for(vector<baiChunk>::iterator c = b->second.begin(); c != b->second.end(); c++){
+	putLong(raw, (*c).beg);
+	putLong(raw, (*c).end);
+      }
+    }
+
+    putInt(raw, (*r).linear.size());
+    for(vector<uint64_t>::iterator l = (*r).linear.begin(); l != (*r).linear.end(); l++){
+      putLong(raw, *l);
+    }
+  }
+
+  return save(path, raw);
+}
+
+// CSI with the .bai geometry (14 bit windows, 5 levels).  In place of
+// the linear index each bin carries the offset of the window it starts
+// in, which is where a query starting in that bin may begin reading.
+
+bool tbiIndex::writeCsi(const string & path){
+
+  fillLinear();
+
+  string raw;
+
+  raw.append("CSI\1", 4);
+  putInt(raw, BAI_LINEAR_SHIFT);
+  putInt(raw, 5);
+  putInt(raw, 0);   // no auxiliary data for BCF
+  putInt(raw, refs.size());
+
+  for(vector<tbiReference>::iterator r = refs.begin(); r != refs.end(); r++){
+
+    putInt(raw, (*r).bins.size());
+
+    for(map<uint32_t, vector<baiChunk> >::iterator b = (*r).bins.begin(); b != (*r).bins.end(); b++){
+
+      // the level of the bin and the first position it covers
+      int      level = 0;
+      uint32_t first = 0;
+      for(uint32_t t = 0; level < 6; level++, t = t * 8 + 1){
+	if(b->first < t * 8 + 1){
+	  first = (b->first - t) << (BAI_LINEAR_SHIFT + 3 * (5 - level));
+	  break;
+	}
+      }
+
+      uint64_t window = first >> BAI_LINEAR_SHIFT;
+      uint64_t offset = 0;
+
+      if(!(*r).linear.empty()){
+	offset = (*r).linear[min(window, (uint64_t)(*r).linear.size() - 1)];
+      }
+
+      putInt(raw, b->first);
+      putLong(raw, offset);
+      putInt(raw, b->second.size());
+      for(vector<baiChunk>::iterator c = b->second.begin(); c != b->second.end(); c++){
+	putLong(raw, (*c).beg);
+	putLong(raw, (*c).end);
+      }
+    }
+  }
+
+  return save(path, raw);
+}
+
+// indices are BGZF compressed themselves
+
+bool tbiIndex::save(const string & path, const string & raw){
+
+  string             compressed;
+  vector<uint32_t>   blocks;
+  bgzfDeflater       deflater;
+
+  deflater.compress(raw.data(), raw.size(), compressed, blocks);
+  bgzfDeflater::eof(compressed);
+
+  FILE * fp = fopen(path.c_str(), "wb");
+
+  if(fp == NULL){
+    return false;
+  }
+
+  bool ok = fwrite(compressed.data(), 1, compressed.size(), fp) == compressed.size();
+
+  return fclose(fp) == 0 && ok;
+}
@@ -0,0 +1,44 @@
+//
+//  tbiIndex.h
+//  wham
+//
+
+#ifndef tbiIndex_h
+#define tbiIndex_h
+
+#include "baiIndex.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+struct tbiReference{
+  std::map<uint32_t, std::vector<baiChunk> > bins;
+  std::vector<uint64_t> linear; // 0 for windows with no record yet
+};
+
+// tabix index of a BGZF compressed VCF, built while the records are
+// written in order.  Positions are 0 based and half open, offsets are
+// BGZF virtual offsets, as in a .bai.  The same bins also make the CSI
+// index that BCF files use.
+
+class tbiIndex {
+
+ public:
+
+  std::vector<std::string>  names;
+  std::vector<tbiReference> refs ;
+
+  void init(const std::vector<std::string> &);
+  void add(int, uint32_t, uint32_t, uint64_t, uint64_t);
+  bool write(const std::string &);
+  bool writeCsi(const std::string &);
+
+ private:
+
+  void fillLinear(void);
+  bool save(const std::string &, const std::string &);
+};
+
+#endif
@@ -0,0 +1,453 @@
+//
+//  vcfWriter.cpp
+//  wham
+//
+
+#include "vcfWriter.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <deque>
+#include <iostream>
+#include <algorithm>
+#include <stdlib.h>
+#include <omp.h>
+
+using namespace std;
+
+void appendInt(string & s, long int v){
+
+  char buf[24];
+  char * e = buf + sizeof(buf);
+  char * p = e;
+
+  unsigned long int u = v < 0 ? 0UL - (unsigned long int) v : (unsigned long int) v;
+
+  do{
+    *--p = '0' + (u % 10);
+    u /= 10;
+  } while(u > 0);
+
+  if(v < 0){
+    *--p = '-';
+  }
+  s.append(p, e - p);
+}
+
+// whole numbers below 1e6 print as integers under %g; -0 prints as "-0"
+
+void appendFloat(string & s, double v){
+
+  if(v > -1e6 && v < 1e6 && v == double((long int) v) && !(v == 0 && signbit(v))){
+    appendInt(s, (long int) v);
+    return;
+  }
+
+  char buf[32];
+  int  n = snprintf(buf, sizeof(buf), "%g", v);
+  s.append(buf, n);
+}
+
+void appendFloat(string & s, long double v){
+
+  if(v > -1e6 && v < 1e6 && v == (long double)((long int) v) && !(v == 0 && signbit(v))){
+    appendInt(s, (long int) v);
+    return;
+  }
+
+  char buf[48];
+  int  n = snprintf(buf, sizeof(buf), "%Lg", v);
+  s.append(buf, n);
+}
+
+struct outputChunk{
+  string        text   ; // compressed for BGZF output
+  vector<outputRecord> records;
+  vector<uint32_t>     blocks ; // starts of the BGZF blocks in text
+  long int      region ;
+  bool          last   ; // close() of the region
+  long int      following; // the region after it, for close()
+  int64_t       offset ; // in the spill file once spilled, or -1
+  long int      length ;
+  outputChunk * next   ;
+};
+
+// everything but head, stopping and the wake up belongs to the writer
+// thread.  The writer sets sleeping before it looks at head a last time
+// and waits; a push checks sleeping after it lands, so one of the two
+// always sees the other and the push itself takes no lock.
+
+struct outputQueue{
+  std::atomic<outputChunk *> head;
+  std::atomic<bool>          stopping;
+  std::atomic<bool>          sleeping;
+  std::mutex                 wakeMutex;
+  std::condition_variable    wake;
+  std::thread                writer;
+  ostream                  * out;
+  FILE                     * fp ; // BGZF output
+  int64_t                    written;
+
+  long int nextRegion;
+  map<long int, deque<outputChunk *> > held;
+
+  FILE *  spill   ;
+  int64_t spillEnd;
+  string  readBack;
+};
+
+outputWriter output;
+
+outputWriter::outputWriter(){
+  q = new outputQueue;
+  q->head       = NULL;
+  q->stopping   = false;
+  q->sleeping   = false;
+  q->out        = NULL;
+  q->fp         = NULL;
+  q->written    = 0;
+  q->nextRegion = 0;
+  q->spill      = NULL;
+  q->spillEnd   = 0;
+  csi           = false;
+  nHeld         = 0;
+  maxHeld       = 0;
+  nSpilled      = 0;
+}
+
+outputWriter::~outputWriter(){
+  stop();
+  if(q->spill != NULL){
+    fclose(q->spill);
+  }
+  for(vector<bgzfDeflater *>::iterator d = deflaters.begin(); d != deflaters.end(); d++){
+    delete *d;
+  }
+  delete q;
+}
+
+// header is written before any region
+
+void outputWriter::start(ostream & out, const string & header){
+  stop();
+  q->out        = &out;
+  q->stopping   = false;
+  q->nextRegion = 0;
+  q->out->write(header.data(), header.size());
+  q->writer     = std::thread(&outputWriter::work, this);
+}
+
+bool outputWriter::start(const string & path, const vector<string> & refNames, const string & header, bool csiIndex){
+
+  stop();
+
+  q->fp = fopen(path.c_str(), "wb");
+  if(q->fp == NULL){
+    return false;
+  }
+
+  for(int t = deflaters.size(); t < omp_get_max_threads(); t++){
+    deflaters.push_back(new bgzfDeflater);
+  }
+
+  index.init(refNames);
+  csi       = csiIndex;
+  indexPath = path + (csi ? ".csi" : ".tbi");
+
+  // the header gets blocks of its own, so no record starts at offset 0
+  string           compressed;
+  vector<uint32_t> blocks;
+
+  deflaters[0]->compress(header.data(), header.size(), compressed, blocks);
+
+  if(fwrite(compressed.data(), 1, compressed.size(), q->fp) != compressed.size()){
+    return false;
+  }
+
+  q->written    = compressed.size();
+  q->stopping   = false;
+  q->nextRegion = 0;
+  q->writer     = std::thread(&outputWriter::work, this);
+
+  return true;
+}
+
+static void wakeWriter(outputQueue * q){
+  if(q->sleeping){
+    std::lock_guard<std::mutex> guard(q->wakeMutex);
+    q->wake.notify_one();
+  }
+}
+
+static void push(outputQueue * q, outputChunk * c){
+  c->next = q->head.load();
+  while(!q->head.compare_exchange_weak(c->next, c)){
+  }
+  wakeWriter(q);
+}
+
+// the text of s and records are taken over and both are left empty
+
+void outputWriter::submit(string & s, long int region, vector<outputRecord> & records){
+
+  if(s.empty()){
+    return;
+  }
+
+  outputChunk * c = new outputChunk;
+
+  if(q->fp != NULL){
+    deflaters[omp_get_thread_num()]->compress(s.data(), s.size(), c->text, c->blocks);
+    c->records.swap(records);
+    s.clear();
+  }
+  else{
+    c->text.swap(s);
+    records.clear();
+  }
+
+  c->region = region;
+  c->last   = false;
+  c->offset = -1;
+  c->length = c->text.size();
+
+  push(q, c);
+}
+
+// nothing more comes for region; following is written next
+
+void outputWriter::close(long int region, long int following){
+
+  outputChunk * c = new outputChunk;
+  c->region    = region;
+  c->last      = true;
+  c->following = following;
+  c->offset = -1;
+  c->length = 0;
+
+  push(q, c);
+}
+
+void outputWriter::stop(void){
+
+  q->stopping = true;
+  {
+    std::lock_guard<std::mutex> guard(q->wakeMutex);
+    q->wake.notify_one();
+  }
+
+  if(q->writer.joinable()){
+    q->writer.join();
+  }
+  // anything handed over after the writer left
+  if(q->out != NULL || q->fp != NULL){
+    work();
+  }
+
+  if(q->fp != NULL){
+
+    string end;
+    bgzfDeflater::eof(end);
+
+    bool ok = fwrite(end.data(), 1, end.size(), q->fp) == end.size();
+    ok = fclose(q->fp) == 0 && ok;
+    q->fp = NULL;
+
+    if(!ok){
+      cerr << "FATAL: could not finish the compressed output" << endl;
+      exit(1);
+    }
+    if(!(csi ? index.writeCsi(indexPath) : index.write(indexPath))){
+      cerr << "FATAL: could not write the index: " << indexPath << endl;
+      exit(1);
+    }
+  }
+}
+
+// a record's virtual offsets follow from where the chunk lands in the
+// file, its block within the chunk and its place in that block
+
+static uint64_t virtualOffset(outputQueue * q, outputChunk * c, uint32_t textOffset){
+  uint32_t block  = textOffset / BGZF_BLOCK_TEXT;
+  uint32_t within = textOffset % BGZF_BLOCK_TEXT;
+  return ((uint64_t)(q->written + c->blocks[block]) << 16) | within;
+}
+
+static void emit(outputWriter * w, outputQueue * q, outputChunk * c){
+
+  const char * bytes = c->text.data();
+
+  if(c->offset >= 0){
+
+    q->readBack.resize(c->length);
+
+    if(fseeko(q->spill, c->offset, SEEK_SET) != 0
+       || fread(&q->readBack[0], 1, c->length, q->spill) != (size_t) c->length){
+      cerr << "FATAL: could not read back held output" << endl;
+      exit(1);
+    }
+    bytes = q->readBack.data();
+  }
+
+  if(q->fp == NULL){
+    q->out->write(bytes, c->length);
+    return;
+  }
+
+  for(vector<outputRecord>::iterator r = c->records.begin(); r != c->records.end(); r++){
+    w->index.add((*r).ref, (*r).beg, (*r).end,
+		 virtualOffset(q, c, (*r).textBeg),
+		 virtualOffset(q, c, (*r).textEnd));
+  }
+
+  if(fwrite(bytes, 1, c->length, q->fp) != (size_t) c->length){
+    cerr << "FATAL: could not write the compressed output" << endl;
+    exit(1);
+  }
+  q->written += c->length;
+}
+
+// writes whatever the regions now up have waiting
+
+static void release(outputWriter * w, outputQueue * q){
+
+  while(true){
+
+    map<long int, deque<outputChunk *> >::iterator h = q->held.find(q->nextRegion);
+
+    if(h == q->held.end()){
+      break;
+    }
+
+    bool     closed    = false;
+    long int following = 0;
+
+    while(!h->second.empty() && !closed){
+      outputChunk * c = h->second.front();
+      h->second.pop_front();
+      emit(w, q, c);
+      if(c->offset < 0){
+	w->nHeld -= c->length;
+      }
+      closed    = c->last;
+      following = c->following;
+      delete c;
+    }
+
+    q->held.erase(h);
+
+    if(!closed){
+      break;
+    }
+    q->nextRegion = following;
+  }
+
+  // the spill file is reused once nothing in it is needed
+  if(q->held.empty()){
+    q->spillEnd = 0;
+  }
+}
+
+static void hold(outputWriter * w, outputQueue * q, outputChunk * c){
+
+  if(w->nHeld + c->length > OUTPUT_REORDER_MAX){
+
+    if(q->spill == NULL){
+      q->spill = tmpfile();
+      if(q->spill == NULL){
+	cerr << "FATAL: could not open a temporary file for held output" << endl;
+	exit(1);
+      }
+    }
+    if(fseeko(q->spill, q->spillEnd, SEEK_SET) != 0
+       || fwrite(c->text.data(), 1, c->length, q->spill) != (size_t) c->length){
+      cerr << "FATAL: could not write held output to a temporary file" << endl;
+      exit(1);
+    }
+    c->offset    = q->spillEnd;
+    q->spillEnd += c->length;
+    w->nSpilled += c->length;
+    string().swap(c->text);
+  }
+  else{
+    w->nHeld  += c->length;
+    w->maxHeld = max(w->maxHeld, w->nHeld);
+  }
+  q->held[c->region].push_back(c);
+}
+
+// takes the whole list at once; it is newest first, so it is turned
+// around to keep the text of each region in order
+
+void outputWriter::work(void){
+
+  while(true){
+
+    outputChunk * c = q->head.exchange(NULL);
+
+    if(c == NULL){
+      if(q->stopping){
+	break;
+      }
+      std::unique_lock<std::mutex> guard(q->wakeMutex);
+      q->sleeping = true;
+      while(q->head.load() == NULL && !q->stopping){
+	q->wake.wait(guard);
+      }
+      q->sleeping = false;
+      continue;
+    }
+
+    outputChunk * ordered = NULL;
+
+    while(c != NULL){
+      outputChunk * next = c->next;
+      c->next = ordered;
+      ordered = c;
+      c       = next;
+    }
+
+    // text of the region being written goes straight out
+
+    while(ordered != NULL){
+      outputChunk * next = ordered->next;
+      if(ordered->region == q->nextRegion && q->held.count(q->nextRegion) == 0){
+	emit(this, q, ordered);
+	if(ordered->last){
+	  q->nextRegion = ordered->following;
+	  release(this, q);
+	}
+	delete ordered;
+      }
+      else{
+	hold(this, q, ordered);
+      }
+      ordered = next;
+    }
+    release(this, q);
+  }
+
+  // regions never closed are written all the same, in order
+  while(!q->held.empty()){
+    map<long int, deque<outputChunk *> >::iterator h = q->held.begin();
+    q->nextRegion = h->first;
+    if(h->second.empty() || !h->second.back()->last){
+      outputChunk * c = new outputChunk;
+      c->region    = h->first;
+      c->last      = true;
+      c->following = h->first + 1;
+      c->offset    = -1;
+      c->length    = 0;
+      h->second.push_back(c);
+    }
+    release(this, q);
+  }
+  if(q->out != NULL){
+    q->out->flush();
+  }
+}
@@ -0,0 +1,87 @@
+//
+//  vcfWriter.h
+//  wham
+//
+
+#ifndef vcfWriter_h
+#define vcfWriter_h
+
+#include "tbiIndex.h"
+#include "bgzf.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <ostream>
+
+// append numbers to a string as ostream << does with its default
+// settings (floats as %g with six significant digits), without a
+// stringstream.  The string keeps its capacity, so a reused buffer
+// stops allocating once it is large enough.
+
+void appendInt(std::string &, long int);
+void appendFloat(std::string &, double);
+void appendFloat(std::string &, long double);
+
+// a record within the text handed to the writer, for the tabix index
+
+struct outputRecord{
+  int32_t  ref    ;
+  uint32_t beg    ; // 0 based, half open
+  uint32_t end    ;
+  uint32_t textBeg;
+  uint32_t textEnd;
+};
+
+// a single thread that writes finished text to one stream.  Scoring
+// threads hand over whole buffers through a lock free list and never
+// wait on the stream.  Text is tagged with the number of the region it
+// belongs to.  Regions are written one after another, each once close()
+// has been called for the one before it; close() names the region that
+// follows, so regions split while running can be chained in between.
+// Text of regions that are
+// not up yet is held back, in memory up to OUTPUT_REORDER_MAX bytes and
+// in a temporary file past that.  The thread and the list live in
+// vcfWriter.cpp to keep <thread> out of the headers.
+//
+// Output goes either to a stream as plain text or to a file as BGZF.
+// With BGZF, submit() compresses on the thread that calls it and the
+// writer only adds up block offsets to build the index, which stop()
+// writes next to the file: tabix for VCF, CSI for BCF.
+
+#define OUTPUT_REORDER_MAX 268435456
+
+struct outputQueue;
+
+class outputWriter {
+
+ public:
+
+  outputQueue * q;
+
+  // held back text, the most at any one time and the bytes spilled
+  long int nHeld    ;
+  long int maxHeld  ;
+  long int nSpilled ;
+
+  outputWriter();
+  ~outputWriter();
+
+  // by omp_get_thread_num(), for BGZF output
+  std::vector<bgzfDeflater *> deflaters;
+
+  tbiIndex    index    ;
+  std::string indexPath;
+  bool        csi      ;
+
+  void start(std::ostream &, const std::string &);
+  bool start(const std::string &, const std::vector<std::string> &, const std::string &, bool);
+  void submit(std::string &, long int, std::vector<outputRecord> &);
+  void close(long int, long int);
+  void stop(void);
+  void work(void);
+};
+
+extern outputWriter output;
+
+#endif